@@ -0,0 +1,4 @@
+#!/bin/sh
+# Replay a few key events to check that bench-m17n runs, it exits
+# with 77 to skip when the schema or the input method is missing.
+exec ./bench-m17n m17n:t:latn-post "$srcdir/bench-smoke.keys"
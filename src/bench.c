@@ -0,0 +1,492 @@
+/* vim:set et sts=4: */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <ibus.h>
+#include <locale.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+#include "engine.h"
+#include "m17nutil.h"
+
+/* Replay recorded key events through an engine without ibus-daemon.
+
+   Usage: bench-m17n [OPTION...] m17n:LANG:NAME KEYFILE...
+
+   Each line of a key file is "KEYVAL KEYCODE MODIFIERS DELAY", where
+   KEYVAL is a key name or a hexadecimal number starting with 0x,
+   KEYCODE and MODIFIERS are numbers (MODIFIERS includes
+   IBUS_RELEASE_MASK for key releases) and DELAY is the time in
+   milliseconds since the previous key event.  Empty lines and lines
+   starting with '#' are ignored.
+
+   The latency of a key event includes the work it leaves to idle
+   callbacks, which is also reported on its own as deferred. */
+
+#define ENGINE_OBJECT_PATH "/org/freedesktop/IBus/Engine/1"
+
+/* exit status telling automake that a test was skipped */
+#define EXIT_SKIP 77
+
+struct _BenchKeyEvent {
+    guint keyval;
+    guint keycode;
+    guint modifiers;
+    guint delay;
+};
+typedef struct _BenchKeyEvent BenchKeyEvent;
+
+/* options */
+static gint iterations = 1;
+static gboolean no_delay = FALSE;
+
+static const GOptionEntry entries[] =
+{
+    { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "replay the key files N times", "N" },
+    { "no-delay", 'd', 0, G_OPTION_ARG_NONE, &no_delay, "ignore the delays in the key files", NULL },
+    { NULL },
+};
+
+static volatile gint messages = 0;
+static GHashTable *signals = NULL;
+G_LOCK_DEFINE_STATIC (signals);
+
+#ifdef __GLIBC__
+/* Count heap allocations by wrapping the glibc allocator, GLib uses
+   it unless a different GMemVTable is set. */
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static volatile gint allocations = 0;
+
+void *
+malloc (size_t size)
+{
+    g_atomic_int_inc (&allocations);
+    return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+    g_atomic_int_inc (&allocations);
+    return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+    g_atomic_int_inc (&allocations);
+    return __libc_realloc (ptr, size);
+}
+
+#define bench_allocations() ((guint) g_atomic_int_get (&allocations))
+#else
+#define bench_allocations() 0
+#endif  /* __GLIBC__ */
+
+static gint64
+bench_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (gint64) ts.tv_sec * G_GINT64_CONSTANT (1000000000) + ts.tv_nsec;
+}
+
+/* Count the messages the engine sends, by signal name */
+static GDBusMessage *
+bench_message_filter (GDBusConnection *connection,
+                      GDBusMessage    *message,
+                      gboolean         incoming,
+                      gpointer         user_data)
+{
+    const gchar *member;
+
+    if (incoming)
+        return message;
+
+    g_atomic_int_inc (&messages);
+
+    member = g_dbus_message_get_member (message);
+    if (member != NULL) {
+        guint count;
+
+        G_LOCK (signals);
+        count = GPOINTER_TO_UINT (g_hash_table_lookup (signals, member));
+        g_hash_table_replace (signals, g_strdup (member),
+                              GUINT_TO_POINTER (count + 1));
+        G_UNLOCK (signals);
+    }
+
+    return message;
+}
+
+static void
+bench_server_ready_cb (GObject      *source_object,
+                       GAsyncResult *res,
+                       gpointer      user_data)
+{
+    GDBusConnection **server = user_data;
+    GError *error = NULL;
+
+    *server = g_dbus_connection_new_finish (res, &error);
+    if (*server == NULL) {
+        g_printerr ("Can not create the stub connection: %s\n",
+                    error->message);
+        exit (EXIT_FAILURE);
+    }
+}
+
+static GIOStream *
+bench_socket_stream_new (gint fd)
+{
+    GSocket *socket;
+    GIOStream *stream;
+    GError *error = NULL;
+
+    socket = g_socket_new_from_fd (fd, &error);
+    if (socket == NULL) {
+        g_printerr ("Can not create socket: %s\n", error->message);
+        exit (EXIT_FAILURE);
+    }
+    stream = (GIOStream *) g_socket_connection_factory_create_connection (socket);
+    g_object_unref (socket);
+
+    return stream;
+}
+
+/* Create a peer-to-peer connection to a stub which swallows whatever
+   the engine sends. */
+static GDBusConnection *
+bench_connection_new (GDBusConnection **server)
+{
+    GIOStream *client_stream, *server_stream;
+    GDBusConnection *client;
+    gchar *guid;
+    gint fds[2];
+    GError *error = NULL;
+
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        g_printerr ("Can not create socket pair\n");
+        exit (EXIT_FAILURE);
+    }
+    client_stream = bench_socket_stream_new (fds[0]);
+    server_stream = bench_socket_stream_new (fds[1]);
+
+    /* The server side authenticates in a thread while the client side
+       blocks. */
+    guid = g_dbus_generate_guid ();
+    *server = NULL;
+    g_dbus_connection_new (server_stream,
+                           guid,
+                           G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_SERVER |
+                           G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_ALLOW_ANONYMOUS,
+                           NULL,
+                           NULL,
+                           bench_server_ready_cb,
+                           server);
+    client = g_dbus_connection_new_sync (client_stream,
+                                         NULL,
+                                         G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT,
+                                         NULL,
+                                         NULL,
+                                         &error);
+    if (client == NULL) {
+        g_printerr ("Can not create the stub connection: %s\n",
+                    error->message);
+        exit (EXIT_FAILURE);
+    }
+    while (*server == NULL)
+        g_main_context_iteration (NULL, TRUE);
+
+    g_free (guid);
+    g_object_unref (client_stream);
+    g_object_unref (server_stream);
+
+    g_dbus_connection_add_filter (client, bench_message_filter, NULL, NULL);
+
+    return client;
+}
+
+static GArray *
+bench_read_keys (const gchar *filename)
+{
+    GArray *keys;
+    gchar *contents, **lines;
+    GError *error = NULL;
+    gint i;
+
+    if (!g_file_get_contents (filename, &contents, NULL, &error)) {
+        g_printerr ("Can not read %s: %s\n", filename, error->message);
+        exit (EXIT_FAILURE);
+    }
+
+    keys = g_array_new (FALSE, FALSE, sizeof (BenchKeyEvent));
+    lines = g_strsplit (contents, "\n", -1);
+    g_free (contents);
+
+    for (i = 0; lines[i] != NULL; i++) {
+        BenchKeyEvent key;
+        gchar name[64];
+        gint keycode, modifiers, delay;
+
+        g_strstrip (lines[i]);
+        if (lines[i][0] == '\0' || lines[i][0] == '#')
+            continue;
+
+        if (sscanf (lines[i], "%63s %i %i %i",
+                    name, &keycode, &modifiers, &delay) != 4) {
+            g_printerr ("%s:%d: expected 4 fields\n", filename, i + 1);
+            exit (EXIT_FAILURE);
+        }
+
+        if (g_str_has_prefix (name, "0x"))
+            key.keyval = strtoul (name, NULL, 16);
+        else
+            key.keyval = ibus_keyval_from_name (name);
+        if (key.keyval == IBUS_VoidSymbol) {
+            g_printerr ("%s:%d: unknown key %s\n", filename, i + 1, name);
+            exit (EXIT_FAILURE);
+        }
+        key.keycode = keycode;
+        key.modifiers = modifiers;
+        key.delay = delay;
+        g_array_append_val (keys, key);
+    }
+    g_strfreev (lines);
+
+    return keys;
+}
+
+static gboolean
+bench_delay_cb (gpointer user_data)
+{
+    g_main_loop_quit ((GMainLoop *) user_data);
+    return G_SOURCE_REMOVE;
+}
+
+/* Run the main loop for DELAY milliseconds, forwarded key events of
+   the engine are released meanwhile. */
+static void
+bench_delay (GMainLoop *loop,
+             guint      delay)
+{
+    if (no_delay || delay == 0) {
+        while (g_main_context_iteration (NULL, FALSE))
+            ;
+        return;
+    }
+    g_timeout_add (delay, bench_delay_cb, loop);
+    g_main_loop_run (loop);
+}
+
+/* Run the main loop until the engine has nothing left to send */
+static void
+bench_settle (GMainLoop *loop)
+{
+    g_timeout_add (100, bench_delay_cb, loop);
+    g_main_loop_run (loop);
+    while (g_main_context_iteration (NULL, FALSE))
+        ;
+}
+
+static gint
+bench_compare_latency (gconstpointer a,
+                       gconstpointer b)
+{
+    gint64 x = *(const gint64 *) a;
+    gint64 y = *(const gint64 *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void
+bench_print_signal (gpointer key,
+                    gpointer value,
+                    gpointer user_data)
+{
+    guint nkeys = GPOINTER_TO_UINT (user_data);
+
+    g_print ("  %-28s %10u %10.2f/key\n",
+             (const gchar *) key,
+             GPOINTER_TO_UINT (value),
+             (gdouble) GPOINTER_TO_UINT (value) / nkeys);
+}
+
+int
+main (gint argc, gchar **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context;
+    GSettingsSchema *schema;
+    GDBusConnection *connection, *server;
+    GMainLoop *loop;
+    IBusEngine *engine;
+    IBusEngineClass *engine_class;
+    GType type;
+    GArray *keys, *latencies, *deferred;
+    guint allocated = 0, nmessages, nkeys, i, j, k;
+    gint64 total = 0, total_deferred = 0, start;
+
+    setlocale (LC_ALL, "");
+
+    context = g_option_context_new ("m17n:LANG:NAME KEYFILE... - replay key events through an engine");
+    g_option_context_add_main_entries (context, entries, "ibus-m17n");
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_print ("Option parsing failed: %s\n", error->message);
+        g_error_free (error);
+        exit (EXIT_FAILURE);
+    }
+    g_option_context_free (context);
+
+    if (argc < 3) {
+        g_printerr ("Usage: %s [OPTION...] m17n:LANG:NAME KEYFILE...\n",
+                    argv[0]);
+        exit (EXIT_FAILURE);
+    }
+
+    /* Keep the user settings out of the measurement. */
+    g_setenv ("GSETTINGS_BACKEND", "memory", TRUE);
+    schema = g_settings_schema_source_lookup (g_settings_schema_source_get_default (),
+                                              "org.freedesktop.ibus.engine.m17n",
+                                              TRUE);
+    if (schema == NULL) {
+        g_printerr ("GSettings schema is not installed, set GSETTINGS_SCHEMA_DIR\n");
+        exit (EXIT_SKIP);
+    }
+    g_settings_schema_unref (schema);
+
+    ibus_init ();
+    ibus_m17n_init_common ();
+
+    signals = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    connection = bench_connection_new (&server);
+    loop = g_main_loop_new (NULL, FALSE);
+
+    type = ibus_m17n_engine_get_type_for_name (argv[1]);
+    if (type == G_TYPE_INVALID) {
+        g_printerr ("Invalid engine name %s\n", argv[1]);
+        exit (EXIT_FAILURE);
+    }
+    engine = g_object_new (type,
+                           "engine-name", argv[1],
+                           "object-path", ENGINE_OBJECT_PATH,
+                           "connection", connection,
+                           NULL);
+    if (engine == NULL) {
+        g_printerr ("Can not open %s\n", argv[1]);
+        exit (EXIT_SKIP);
+    }
+    engine->client_capabilities = IBUS_CAP_PREEDIT_TEXT |
+                                  IBUS_CAP_AUXILIARY_TEXT |
+                                  IBUS_CAP_LOOKUP_TABLE |
+                                  IBUS_CAP_FOCUS |
+                                  IBUS_CAP_PROPERTY;
+    engine_class = IBUS_ENGINE_GET_CLASS (engine);
+
+    keys = g_array_new (FALSE, FALSE, sizeof (BenchKeyEvent));
+    for (i = 2; i < (guint) argc; i++) {
+        GArray *file_keys = bench_read_keys (argv[i]);
+        g_array_append_vals (keys, file_keys->data, file_keys->len);
+        g_array_free (file_keys, TRUE);
+    }
+    if (keys->len == 0) {
+        g_printerr ("No key events to replay\n");
+        exit (EXIT_FAILURE);
+    }
+
+    engine_class->enable (engine);
+    engine_class->focus_in (engine);
+    bench_delay (loop, 0);
+
+    /* Only count what the key events cause. */
+    g_atomic_int_set (&messages, 0);
+    G_LOCK (signals);
+    g_hash_table_remove_all (signals);
+    G_UNLOCK (signals);
+
+    nkeys = keys->len * MAX (iterations, 1);
+    latencies = g_array_sized_new (FALSE, FALSE, sizeof (gint64), nkeys);
+    deferred = g_array_sized_new (FALSE, FALSE, sizeof (gint64), nkeys);
+    for (j = 0, k = 0; j < (guint) MAX (iterations, 1); j++) {
+        for (i = 0; i < keys->len; i++, k++) {
+            BenchKeyEvent *key = &g_array_index (keys, BenchKeyEvent, i);
+            guint before;
+            gint64 latency, idle;
+
+            bench_delay (loop, key->delay);
+
+            before = bench_allocations ();
+            start = bench_now ();
+            engine_class->process_key_event (engine,
+                                             key->keyval,
+                                             key->keycode,
+                                             key->modifiers);
+            latency = bench_now () - start;
+
+            /* Updates deferred to an idle callback belong to the key
+               event as well. */
+            start = bench_now ();
+            while (g_main_context_iteration (NULL, FALSE))
+                ;
+            idle = bench_now () - start;
+            allocated += bench_allocations () - before;
+
+            latency += idle;
+            g_array_append_val (latencies, latency);
+            g_array_append_val (deferred, idle);
+            total += latency;
+            total_deferred += idle;
+        }
+    }
+
+    /* Let forwarded key events still delayed by the engine go out,
+       outgoing messages pass the filter before they are written. */
+    bench_settle (loop);
+    g_dbus_connection_flush_sync (connection, NULL, NULL);
+    nmessages = g_atomic_int_get (&messages);
+
+    g_array_sort (latencies, bench_compare_latency);
+    g_array_sort (deferred, bench_compare_latency);
+
+    g_print ("engine:              %s\n", argv[1]);
+    g_print ("key events:          %u\n", nkeys);
+    g_print ("keys/sec:            %.0f\n",
+             total > 0 ? nkeys * 1e9 / total : 0.0);
+    g_print ("latency p50:         %.1f us\n",
+             g_array_index (latencies, gint64, nkeys / 2) / 1e3);
+    g_print ("latency p99:         %.1f us\n",
+             g_array_index (latencies, gint64, (nkeys - 1) * 99 / 100) / 1e3);
+    g_print ("latency max:         %.1f us\n",
+             g_array_index (latencies, gint64, nkeys - 1) / 1e3);
+    g_print ("deferred mean:       %.1f us\n",
+             total_deferred / 1e3 / nkeys);
+    g_print ("deferred max:        %.1f us\n",
+             g_array_index (deferred, gint64, nkeys - 1) / 1e3);
+#ifdef __GLIBC__
+    g_print ("allocations/key:     %.2f\n", (gdouble) allocated / nkeys);
+#endif  /* __GLIBC__ */
+    g_print ("D-Bus messages/key:  %.2f\n",
+             (gdouble) nmessages / nkeys);
+    G_LOCK (signals);
+    g_hash_table_foreach (signals, bench_print_signal, GUINT_TO_POINTER (nkeys));
+    G_UNLOCK (signals);
+
+    g_array_free (latencies, TRUE);
+    g_array_free (deferred, TRUE);
+    g_array_free (keys, TRUE);
+    engine_class->focus_out (engine);
+    ibus_object_destroy ((IBusObject *) engine);
+    g_object_unref (engine);
+    g_object_unref (connection);
+    g_object_unref (server);
+    g_main_loop_unref (loop);
+
+    return EXIT_SUCCESS;
+}
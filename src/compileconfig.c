@@ -0,0 +1,28 @@
+/* vim:set et sts=4: */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include "m17nutil.h"
+
+/* Compile default.xml and optional override files into the binary
+   form loaded by the engine, see ibus_m17n_config_compile(). */
+int
+main (gint argc, gchar **argv)
+{
+    GError *error = NULL;
+
+    if (argc < 3) {
+        g_printerr ("Usage: %s OUTPUT XML-FILE...\n", argv[0]);
+        exit (EXIT_FAILURE);
+    }
+
+    if (!ibus_m17n_config_compile (argv + 2, argv[1], &error)) {
+        g_printerr ("%s: %s\n", argv[0], error->message);
+        g_error_free (error);
+        exit (EXIT_FAILURE);
+    }
+
+    return 0;
+}
@@ -0,0 +1,219 @@
+/* vim:set et sts=4: */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <glib.h>
+#include "directmap.h"
+
+/* Node of a map being built */
+struct _DirectMapBuildNode {
+    const gchar *key;
+    const gchar *output;
+    /* key -> DirectMapBuildNode */
+    GHashTable *children;
+};
+typedef struct _DirectMapBuildNode DirectMapBuildNode;
+
+/* Node of a compiled map.  The children of a node are consecutive and
+   sorted by key. */
+struct _DirectMapNode {
+    const gchar *key;
+    const gchar *output;
+    guint first_child;
+    guint n_children;
+};
+typedef struct _DirectMapNode DirectMapNode;
+
+struct _IBusM17NDirectMap {
+    /* keys and outputs of all nodes */
+    GStringChunk *strings;
+    /* DirectMapBuildNode, NULL once compiled */
+    GPtrArray *build_nodes;
+    DirectMapNode *nodes;
+    guint n_nodes;
+};
+
+static DirectMapBuildNode *
+direct_map_build_node_new (IBusM17NDirectMap *map,
+                           const gchar       *key)
+{
+    DirectMapBuildNode *node = g_slice_new0 (DirectMapBuildNode);
+
+    node->key = key;
+    g_ptr_array_add (map->build_nodes, node);
+    return node;
+}
+
+static void
+direct_map_build_node_free (gpointer data)
+{
+    DirectMapBuildNode *node = data;
+
+    if (node->children)
+        g_hash_table_destroy (node->children);
+    g_slice_free (DirectMapBuildNode, node);
+}
+
+IBusM17NDirectMap *
+ibus_m17n_direct_map_new (void)
+{
+    IBusM17NDirectMap *map = g_slice_new0 (IBusM17NDirectMap);
+
+    map->strings = g_string_chunk_new (1024);
+    map->build_nodes = g_ptr_array_new_with_free_func (direct_map_build_node_free);
+    direct_map_build_node_new (map, NULL);
+
+    return map;
+}
+
+void
+ibus_m17n_direct_map_free (IBusM17NDirectMap *map)
+{
+    if (map->build_nodes)
+        g_ptr_array_free (map->build_nodes, TRUE);
+    g_free (map->nodes);
+    g_string_chunk_free (map->strings);
+    g_slice_free (IBusM17NDirectMap, map);
+}
+
+gboolean
+ibus_m17n_direct_map_add (IBusM17NDirectMap  *map,
+                          const gchar       **keys,
+                          guint               n_keys,
+                          const gchar        *output)
+{
+    DirectMapBuildNode *node;
+    guint i;
+
+    g_return_val_if_fail (map->build_nodes != NULL, FALSE);
+
+    node = g_ptr_array_index (map->build_nodes, IBUS_M17N_DIRECT_MAP_ROOT);
+    for (i = 0; i < n_keys; i++) {
+        DirectMapBuildNode *child = NULL;
+
+        if (node->children == NULL)
+            node->children = g_hash_table_new (g_str_hash, g_str_equal);
+        else
+            child = g_hash_table_lookup (node->children, keys[i]);
+
+        if (child == NULL) {
+            const gchar *key = g_string_chunk_insert_const (map->strings,
+                                                            keys[i]);
+
+            child = direct_map_build_node_new (map, key);
+            g_hash_table_insert (node->children, (gpointer) key, child);
+        }
+        node = child;
+    }
+
+    if (node->output != NULL)
+        return strcmp (node->output, output) == 0;
+    node->output = g_string_chunk_insert_const (map->strings, output);
+    return TRUE;
+}
+
+static gint
+direct_map_compare_build_nodes (gconstpointer a,
+                                gconstpointer b)
+{
+    const DirectMapBuildNode *node_a = *(const DirectMapBuildNode **) a;
+    const DirectMapBuildNode *node_b = *(const DirectMapBuildNode **) b;
+
+    return strcmp (node_a->key, node_b->key);
+}
+
+gboolean
+ibus_m17n_direct_map_compile (IBusM17NDirectMap *map)
+{
+    GQueue queue = G_QUEUE_INIT;
+    GPtrArray *children;
+    DirectMapBuildNode *node;
+    guint n_nodes = 0;
+    gboolean ok = TRUE;
+
+    g_return_val_if_fail (map->build_nodes != NULL, FALSE);
+
+    node = g_ptr_array_index (map->build_nodes, IBUS_M17N_DIRECT_MAP_ROOT);
+    if (node->children == NULL)
+        return FALSE;
+
+    /* Breadth first, so the children of each node are consecutive. */
+    map->nodes = g_new0 (DirectMapNode, map->build_nodes->len);
+    children = g_ptr_array_new ();
+    map->nodes[n_nodes++].key = NULL;
+    g_queue_push_tail (&queue, node);
+
+    for (; (node = g_queue_pop_head (&queue)) != NULL; map->n_nodes++) {
+        DirectMapNode *cnode = &map->nodes[map->n_nodes];
+        GHashTableIter iter;
+        gpointer value;
+        guint i;
+
+        cnode->output = node->output;
+        if (node->children == NULL)
+            continue;
+
+        if (map->n_nodes != IBUS_M17N_DIRECT_MAP_ROOT && node->output == NULL)
+            ok = FALSE;
+
+        g_ptr_array_set_size (children, 0);
+        g_hash_table_iter_init (&iter, node->children);
+        while (g_hash_table_iter_next (&iter, NULL, &value))
+            g_ptr_array_add (children, value);
+        g_ptr_array_sort (children, direct_map_compare_build_nodes);
+
+        cnode->first_child = n_nodes;
+        cnode->n_children = children->len;
+        for (i = 0; i < children->len; i++) {
+            DirectMapBuildNode *child = g_ptr_array_index (children, i);
+
+            map->nodes[n_nodes++].key = child->key;
+            g_queue_push_tail (&queue, child);
+        }
+    }
+
+    g_ptr_array_free (children, TRUE);
+    g_ptr_array_free (map->build_nodes, TRUE);
+    map->build_nodes = NULL;
+
+    return ok;
+}
+
+gint
+ibus_m17n_direct_map_step (const IBusM17NDirectMap *map,
+                           guint                    node,
+                           const gchar             *key)
+{
+    const DirectMapNode *cnode = &map->nodes[node];
+    guint low = cnode->first_child;
+    guint high = cnode->first_child + cnode->n_children;
+
+    while (low < high) {
+        guint middle = (low + high) / 2;
+        gint cmp = strcmp (key, map->nodes[middle].key);
+
+        if (cmp == 0)
+            return middle;
+        if (cmp < 0)
+            high = middle;
+        else
+            low = middle + 1;
+    }
+    return -1;
+}
+
+const gchar *
+ibus_m17n_direct_map_get_output (const IBusM17NDirectMap *map,
+                                 guint                    node)
+{
+    return map->nodes[node].output;
+}
+
+gboolean
+ibus_m17n_direct_map_is_leaf (const IBusM17NDirectMap *map,
+                              guint                    node)
+{
+    return map->nodes[node].n_children == 0;
+}
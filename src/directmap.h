@@ -0,0 +1,44 @@
+/* vim:set et sts=4: */
+#ifndef __DIRECTMAP_H__
+#define __DIRECTMAP_H__
+
+#include <glib.h>
+
+/* A trie from key sequences to output strings, for input methods
+   which need nothing else, see ibus_m17n_mim_direct_map_load().
+   Nodes are numbered, keys are m17n key symbol names. */
+typedef struct _IBusM17NDirectMap IBusM17NDirectMap;
+
+/* The node where no key sequence is pending */
+#define IBUS_M17N_DIRECT_MAP_ROOT 0
+
+IBusM17NDirectMap
+           *ibus_m17n_direct_map_new        (void);
+void        ibus_m17n_direct_map_free       (IBusM17NDirectMap  *map);
+
+/* Map the key sequence KEYS to OUTPUT.  Return FALSE if the sequence
+   is already mapped to something else. */
+gboolean    ibus_m17n_direct_map_add        (IBusM17NDirectMap  *map,
+                                             const gchar       **keys,
+                                             guint               n_keys,
+                                             const gchar        *output);
+
+/* Lay out the nodes for lookups, no sequence can be added afterwards.
+   Return FALSE if a proper prefix of a sequence has no output of its
+   own, which the map can not show as preedit. */
+gboolean    ibus_m17n_direct_map_compile    (IBusM17NDirectMap  *map);
+
+/* Return the node reached from NODE by KEY, or -1 */
+gint        ibus_m17n_direct_map_step       (const IBusM17NDirectMap
+                                                                *map,
+                                             guint               node,
+                                             const gchar        *key);
+const gchar *
+            ibus_m17n_direct_map_get_output (const IBusM17NDirectMap
+                                                                *map,
+                                             guint               node);
+gboolean    ibus_m17n_direct_map_is_leaf    (const IBusM17NDirectMap
+                                                                *map,
+                                             guint               node);
+
+#endif
@@ -3,16 +3,29 @@
 #include <config.h>
 #endif
 
-#include <time.h>
 #include <gio/gio.h>
+#include <glib/gstdio.h>
 #include <ibus.h>
+#include <locale.h>
 #include <m17n.h>
 #include <string.h>
+#ifdef HAVE_MALLINFO2
+#include <malloc.h>
+#endif
 #include "m17nutil.h"
+#include "mimscan.h"
 #include "engine.h"
+#include "trace.h"
 
 typedef struct _IBusM17NEngine IBusM17NEngine;
 typedef struct _IBusM17NEngineClass IBusM17NEngineClass;
+typedef struct _IBusM17NKeymapTable IBusM17NKeymapTable;
+
+typedef enum {
+    ENGINE_UPDATE_PREEDIT_MASK = 1 << 0,
+    ENGINE_UPDATE_LOOKUP_TABLE_MASK = 1 << 1,
+    ENGINE_UPDATE_STATUS_MASK = 1 << 2
+} EngineUpdateMask;
 
 struct _IBusM17NEngine {
     IBusEngineSimple parent;
@@ -25,11 +38,122 @@ struct _IBusM17NEngine {
     IBusProperty    *setup_prop;
 #endif  /* HAVE_SETUP */
     IBusPropList    *prop_list;
-    IBusKeymap      *us_keymap;
     IBusInputPurpose purpose;
     IBusInputHints   hints;
+
+    /* reusable buffer for converting MText to UTF-8 */
+    GString         *scratch;
+
+    /* changes not sent to the client yet, see
+       ibus_m17n_engine_flush_updates() */
+    EngineUpdateMask updates;
+
+    /* candidate group shown in the lookup table, see
+       ibus_m17n_engine_update_lookup_table() */
+    MPlist          *candidate_list;
+    MPlist          *candidate_group;
+    gint             candidate_offset;
+    gint             candidate_group_page;
+    gint             candidate_npages;
+    /* page shown in the auxiliary text, 0 if hidden */
+    gint             candidate_page;
+    gboolean         lookup_table_visible;
+
+    /* preedit the client has, valid unless preedit_valid is FALSE */
+    GString         *preedit_text;
+    guint            preedit_cursor;
+    gboolean         preedit_visible;
+    gboolean         preedit_valid;
+
+    /* status the property has, valid unless status_valid is FALSE */
+    GString         *status_text;
+    gboolean         status_visible;
+    gboolean         status_valid;
+
+    /* surrounding text fetched from the client, see
+       ibus_m17n_engine_get_surrounding() */
+    IBusText        *surrounding_text;
+    /* byte offset of the cursor in surrounding_text */
+    gsize            surrounding_cursor;
+    /* last window passed to m17n-lib and its length argument */
+    MText           *surrounding;
+    gint             surrounding_len;
+
+    /* key events waiting for a forwarded key event, see
+       ibus_m17n_engine_queue_key_event() */
+    GQueue          *pending_keys;
+    guint            pending_keys_id;
+    gboolean         forward_after_commit;
+
+    /* whether IBusEngineSimple may be in a compose or hex sequence,
+       see ibus_m17n_engine_compose_is_initial() */
+    gboolean         compose_active;
+
+    /* key events with more events queued behind them defer the
+       updates to an idle callback, see
+       ibus_m17n_engine_process_key_event() */
+    gboolean         in_burst;
+    guint            flush_id;
+    /* text committed during a burst, not sent yet */
+    GString         *pending_commit;
+
+    /* pending key sequence if the class has a direct map */
+    guint            direct_node;
+
+    gboolean         has_focus;
+    /* whether context is in its reset state, see
+       ibus_m17n_engine_focus_out() */
+    gboolean         ic_clean;
+};
+
+struct _IBusM17NKeyEvent {
+    guint keyval;
+    guint keycode;
+    guint modifiers;
+    /* forward to the client as is instead of processing it */
+    gboolean forward;
+};
+typedef struct _IBusM17NKeyEvent IBusM17NKeyEvent;
+
+/* Delay in milliseconds between a commit and forwarding the key event
+   which caused it, see ibus_m17n_engine_process_key(). */
+#define FORWARD_KEY_DELAY 20
+
+/* Number of recently used engines opened at startup, see
+   ibus_m17n_engine_prewarm() */
+#define MRU_SIZE 4
+
+/* Keycodes covered by IBusKeymap */
+#define KEYMAP_TABLE_KEYCODES 256
+
+/* Modifiers IBusKeymap distinguishes levels by, bit N of a level
+   corresponds to keymap_level_modifiers[N]. */
+static const guint keymap_level_modifiers[] = {
+    IBUS_SHIFT_MASK,
+    IBUS_LOCK_MASK,
+    IBUS_MOD2_MASK,
+    IBUS_MOD5_MASK,
+};
+#define KEYMAP_TABLE_LEVELS (1 << G_N_ELEMENTS (keymap_level_modifiers))
+
+/* Flattened copy of an IBusKeymap, built once per process and layout
+   and never freed. */
+struct _IBusM17NKeymapTable {
+    guint keysyms[KEYMAP_TABLE_KEYCODES][KEYMAP_TABLE_LEVELS];
 };
 
+/* Maximum number of input contexts pooled per class */
+#define CONTEXT_POOL_SIZE 4
+
+/* Seconds after which an unused context pool is emptied */
+#define CONTEXT_POOL_IDLE_TIMEOUT 30
+
+/* Number of preedit lengths for which attribute lists are cached */
+#define PREEDIT_ATTRS_CACHE_SIZE 32
+
+/* Maximum number of distinct status labels cached per class */
+#define STATUS_LABELS_CACHE_SIZE 64
+
 struct _IBusM17NEngineClass {
     IBusEngineSimpleClass parent;
 
@@ -42,12 +166,46 @@ struct _IBusM17NEngineClass {
     gint lookup_table_orientation;
     gboolean use_us_layout;
 
+    /* layout keys are translated to with use_us_layout or AltGr,
+       shared by all classes with the same reference layout */
+    const IBusM17NKeymapTable *reference_keymap;
+
+    /* preedit attribute lists by preedit length, built from the
+       configuration above on first use and shared by all instances */
+    IBusAttrList *preedit_attrs[PREEDIT_ATTRS_CACHE_SIZE];
+
+    /* status labels by status string, shared by all instances */
+    GHashTable *status_labels;
+
     gchar *title;
     gchar *icon;
     gchar *lang;
     gchar *name;
     gchar *engine_name;
     MInputMethod *im;
+    /* replaces minput_filter() and minput_lookup() if im only maps
+       key sequences to text, see ibus_m17n_engine_direct_filter() */
+    IBusM17NDirectMap *direct_map;
+    /* MSymbol set of the keys im can consume, NULL if unknown */
+    GHashTable *consumed_keys;
+    /* whether im asked for the surrounding text, which must then
+       include every commit, so key events are never batched */
+    gboolean uses_surrounding;
+
+    /* number of live input contexts created from im */
+    guint n_contexts;
+    /* monotonic time n_contexts dropped to 0, see
+       ibus_m17n_engine_evict_ims() */
+    gint64 idle_since;
+    /* estimated heap usage of im in bytes, 0 if unknown, see
+       ibus_m17n_engine_class_open_im() */
+    gsize im_cost;
+
+    /* reset input contexts of destroyed engines, reused by the
+       constructor, see ibus_m17n_engine_class_get_context() */
+    GQueue context_pool;
+    /* monotonic time the pool was last used */
+    gint64 context_pool_used;
 };
 
 /* functions prototype */
@@ -85,24 +243,301 @@ static void ibus_m17n_engine_set_content_type
                                             (IBusEngine             *engine,
                                              IBusInputPurpose        purpose,
                                              IBusInputHints          hints);
+static void ibus_m17n_engine_set_surrounding_text
+                                            (IBusEngine             *engine,
+                                             IBusText               *text,
+                                             guint                   cursor_pos,
+                                             guint                   anchor_pos);
 
+static gboolean
+            ibus_m17n_engine_filter_key_event
+                                            (IBusM17NEngine         *m17n,
+                                             guint                   keyval,
+                                             guint                   keycode,
+                                             guint                   modifiers);
+static void ibus_m17n_key_event_free        (gpointer                data);
+static gboolean
+            ibus_m17n_engine_release_pending_keys_cb
+                                            (gpointer                user_data);
+static void ibus_m17n_engine_release_pending_keys
+                                            (IBusM17NEngine         *m17n,
+                                             gboolean                immediate);
 static void ibus_m17n_engine_commit_string
                                             (IBusM17NEngine         *m17n,
                                              const gchar            *string);
+static void ibus_m17n_engine_clear_surrounding
+                                            (IBusM17NEngine         *m17n);
+static const gchar *
+            ibus_m17n_engine_trace_key      (IBusM17NEngine         *m17n,
+                                             MSymbol                 key);
+static MText *
+            ibus_m17n_engine_get_surrounding
+                                            (IBusM17NEngine         *m17n,
+                                             gint                    len);
 static void ibus_m17n_engine_callback       (MInputContext          *context,
                                              MSymbol                 command);
 static void ibus_m17n_engine_update_preedit (IBusM17NEngine *m17n);
 static void ibus_m17n_engine_update_lookup_table
                                             (IBusM17NEngine *m17n);
+static void ibus_m17n_engine_clear_candidates
+                                            (IBusM17NEngine *m17n);
+static void ibus_m17n_engine_flush_updates  (IBusM17NEngine *m17n);
+static gboolean
+            ibus_m17n_engine_flush_updates_cb
+                                            (gpointer                user_data);
+static void ibus_m17n_engine_flush_commit   (IBusM17NEngine *m17n);
+static void ibus_m17n_engine_reset_ic       (IBusM17NEngine *m17n);
+static void ibus_m17n_engine_evict_ims      (void);
+static gboolean
+            ibus_m17n_engine_mru_contains   (const gchar    *engine_name);
 
 static IBusEngineSimpleClass *parent_class = NULL;
 
+/* Classes with an open input method, most recently used first */
+static GQueue resident_ims = G_QUEUE_INIT;
+static guint im_idle_timeout = IBUS_M17N_IM_IDLE_TIMEOUT;
+static gsize im_memory_budget = 0;
+static guint im_evict_id = 0;
+static guint im_opens = 0;
+static guint im_evictions = 0;
+static guint context_pool_trim_id = 0;
+
+/* Modifiers which are significant for m17n key symbols, in the order
+   their prefixes appear in the symbol name.  Bit N of a modifier
+   index corresponds to key_modifiers[N]. */
+static const struct {
+    guint        mask;
+    const gchar *prefix;
+} key_modifiers[] = {
+    { IBUS_SHIFT_MASK,   "S-" },
+    { IBUS_CONTROL_MASK, "C-" },
+    { IBUS_META_MASK,    "M-" },
+    { IBUS_MOD1_MASK,    "A-" },
+    { IBUS_MOD5_MASK,    "G-" },
+    { IBUS_SUPER_MASK,   "s-" },
+    { IBUS_HYPER_MASK,   "H-" },
+};
+
+#define KEY_MODIFIER_SHIFT_INDEX (1 << 0)
+#define KEY_MODIFIER_CONTROL_INDEX (1 << 1)
+#define KEY_MODIFIER_COMBINATIONS (1 << G_N_ELEMENTS (key_modifiers))
+
+/* Per-process keyval x modifier index -> MSymbol translation table.
+   Each row holds KEY_MODIFIER_COMBINATIONS entries, allocated on the
+   first use of its keyval and filled lazily; a NULL entry has not
+   been computed yet.  Printable ASCII and the 0xff00 function key
+   block have dense rows, other keyvals are found through a hash. */
+static MSymbol *key_table_ascii[IBUS_asciitilde - IBUS_space + 1];
+static MSymbol *key_table_function[0x100];
+static GHashTable *key_table_other = NULL;
+
+/* Pre-interned symbols used by the page and cursor handlers. */
+static MSymbol Mkey_up;
+static MSymbol Mkey_down;
+static MSymbol Mkey_left;
+static MSymbol Mkey_right;
+
+static MSymbol ibus_m17n_key_table_lookup   (guint keyval,
+                                             guint modifiers);
+
+/* Monitors of the compose files of the user and the files which
+   changed since, see ibus_m17n_engine_load_compose_tables() */
+static GPtrArray *compose_monitors = NULL;
+static GPtrArray *compose_changed = NULL;
+
+/* First keyvals of the sequences in the compose files of the locale
+   and the user, NULL if the system file of the locale is unknown */
+static GHashTable *compose_initial_keyvals = NULL;
+
+/* reference layout -> IBusM17NKeymapTable */
+static GHashTable *keymap_tables = NULL;
+
 void
 ibus_m17n_init (IBusBus *bus)
 {
     ibus_m17n_init_common ();
 }
 
+static const IBusM17NKeymapTable *
+ibus_m17n_keymap_table_get (const gchar *layout)
+{
+    IBusM17NKeymapTable *table;
+    IBusKeymap *keymap;
+    guint keycode, level, i;
+
+    if (layout == NULL)
+        layout = "us";
+
+    if (keymap_tables == NULL)
+        keymap_tables = g_hash_table_new (g_str_hash, g_str_equal);
+
+    table = g_hash_table_lookup (keymap_tables, layout);
+    if (table != NULL)
+        return table;
+
+    keymap = ibus_keymap_get (layout);
+    if (keymap == NULL && strcmp (layout, "us") != 0) {
+        g_warning ("Can not load keymap %s, using us", layout);
+        table = (IBusM17NKeymapTable *) ibus_m17n_keymap_table_get ("us");
+        g_hash_table_insert (keymap_tables, g_strdup (layout), table);
+        return table;
+    }
+
+    table = g_new (IBusM17NKeymapTable, 1);
+    for (keycode = 0; keycode < KEYMAP_TABLE_KEYCODES; keycode++) {
+        for (level = 0; level < KEYMAP_TABLE_LEVELS; level++) {
+            guint modifiers = 0;
+
+            for (i = 0; i < G_N_ELEMENTS (keymap_level_modifiers); i++) {
+                if (level & (1 << i))
+                    modifiers |= keymap_level_modifiers[i];
+            }
+            table->keysyms[keycode][level] = keymap == NULL ?
+                IBUS_VoidSymbol :
+                ibus_keymap_lookup_keysym (keymap, keycode, modifiers);
+        }
+    }
+    if (keymap != NULL)
+        g_object_unref (keymap);
+
+    g_hash_table_insert (keymap_tables, g_strdup (layout), table);
+    return table;
+}
+
+static inline guint
+ibus_m17n_keymap_table_lookup (const IBusM17NKeymapTable *table,
+                               guint                      keycode,
+                               guint                      modifiers)
+{
+    guint level = 0;
+    guint i;
+
+    if (keycode >= KEYMAP_TABLE_KEYCODES)
+        return IBUS_VoidSymbol;
+
+    for (i = 0; i < G_N_ELEMENTS (keymap_level_modifiers); i++) {
+        if (modifiers & keymap_level_modifiers[i])
+            level |= 1 << i;
+    }
+    return table->keysyms[keycode][level];
+}
+
+static void
+ibus_m17n_key_table_init (void)
+{
+    if (key_table_other != NULL)
+        return;
+
+    key_table_other = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+
+    Mkey_up = ibus_m17n_key_table_lookup (IBUS_Up, 0);
+    Mkey_down = ibus_m17n_key_table_lookup (IBUS_Down, 0);
+    Mkey_left = ibus_m17n_key_table_lookup (IBUS_Left, 0);
+    Mkey_right = ibus_m17n_key_table_lookup (IBUS_Right, 0);
+}
+
+static guint
+ibus_m17n_key_modifiers_to_index (guint modifiers)
+{
+    guint index = 0;
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (key_modifiers); i++) {
+        if (modifiers & key_modifiers[i].mask)
+            index |= 1 << i;
+    }
+    return index;
+}
+
+static MSymbol
+ibus_m17n_key_symbol_new (guint keyval,
+                          guint index)
+{
+    GString *keysym;
+    MSymbol mkeysym;
+    guint i;
+
+    keysym = g_string_new ("");
+
+    if (keyval >= IBUS_space && keyval <= IBUS_asciitilde) {
+        gint c = keyval;
+
+        if ((index & KEY_MODIFIER_CONTROL_INDEX) && c >= IBUS_a && c <= IBUS_z)
+            c += IBUS_A - IBUS_a;
+        g_string_append_c (keysym, c);
+    }
+    else {
+        const gchar *name = ibus_keyval_name (keyval);
+        if (name == NULL) {
+            g_string_free (keysym, TRUE);
+            return Mnil;
+        }
+        g_string_append (keysym, name);
+        if (index & KEY_MODIFIER_SHIFT_INDEX) {
+            const gunichar unicode = ibus_keyval_to_unicode (keyval);
+            if (g_unichar_isgraph (unicode)) {
+                /*
+                  https://github.com/ibus/ibus-m17n/issues/90
+                  Add the shift prefix only if the unicode character is not “graph”,
+                  that means it is either a space or not printable.
+                  Do not add it for other characters, for example if Shift+ü has
+                  been typed, the keysym is “Udiaeresis” and the Shift has been
+                  absorbed in the uppercase, adding the prefix would result
+                  in the msymbol “S-Udiaeresis”, which would be wrong.
+                 */
+                index &= ~KEY_MODIFIER_SHIFT_INDEX;
+            }
+        }
+    }
+
+    for (i = G_N_ELEMENTS (key_modifiers); i > 0; i--) {
+        if (index & (1 << (i - 1)))
+            g_string_prepend (keysym, key_modifiers[i - 1].prefix);
+    }
+
+    mkeysym = msymbol (keysym->str);
+    g_string_free (keysym, TRUE);
+
+    return mkeysym;
+}
+
+static MSymbol
+ibus_m17n_key_table_lookup (guint keyval,
+                            guint modifiers)
+{
+    MSymbol **row;
+    guint index;
+
+    index = ibus_m17n_key_modifiers_to_index (modifiers);
+
+    if (keyval >= IBUS_space && keyval <= IBUS_asciitilde) {
+        /* Shift is absorbed in printable ASCII except for space. */
+        if (keyval != IBUS_space)
+            index &= ~KEY_MODIFIER_SHIFT_INDEX;
+        row = &key_table_ascii[keyval - IBUS_space];
+    }
+    else if ((keyval & ~0xff) == 0xff00) {
+        row = &key_table_function[keyval & 0xff];
+    }
+    else {
+        MSymbol *other;
+
+        other = g_hash_table_lookup (key_table_other, GUINT_TO_POINTER (keyval));
+        if (other == NULL) {
+            other = g_new0 (MSymbol, KEY_MODIFIER_COMBINATIONS);
+            g_hash_table_insert (key_table_other, GUINT_TO_POINTER (keyval), other);
+        }
+        row = &other;
+    }
+
+    if (G_UNLIKELY (*row == NULL))
+        *row = g_new0 (MSymbol, KEY_MODIFIER_COMBINATIONS);
+    if (G_UNLIKELY ((*row)[index] == NULL))
+        (*row)[index] = ibus_m17n_key_symbol_new (keyval, index);
+
+    return (*row)[index];
+}
+
 static gboolean
 ibus_m17n_scan_engine_name (const gchar *engine_name,
                             gchar      **lang,
@@ -159,6 +594,7 @@ ibus_m17n_scan_class_name (const gchar *class_name,
 GType
 ibus_m17n_engine_get_type_for_name (const gchar *engine_name)
 {
+    static GHashTable *engine_types = NULL;
     GType type;
     gchar *type_name, *lang = NULL, *name = NULL;
     int i;
@@ -175,6 +611,13 @@ ibus_m17n_engine_get_type_for_name (const gchar *engine_name)
         (GInstanceInitFunc)  ibus_m17n_engine_init,
     };
 
+    if (engine_types == NULL)
+        engine_types = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, NULL);
+    type = (GType) g_hash_table_lookup (engine_types, engine_name);
+    if (type != 0)
+        return type;
+
     if (!ibus_m17n_scan_engine_name (engine_name, &lang, &name)) {
         g_free (lang);
         g_free (name);
@@ -203,6 +646,8 @@ ibus_m17n_engine_get_type_for_name (const gchar *engine_name)
     }
     g_free (type_name);
 
+    g_hash_table_insert (engine_types, g_strdup (engine_name), (gpointer) type);
+
     return type;
 }
 
@@ -218,6 +663,8 @@ ibus_m17n_engine_class_init (IBusM17NEngineClass *klass)
     if (parent_class == NULL)
         parent_class = (IBusEngineSimpleClass *) g_type_class_peek_parent (klass);
 
+    ibus_m17n_key_table_init ();
+
     object_class->constructor = ibus_m17n_engine_constructor;
     ibus_object_class->destroy = (IBusObjectDestroyFunc) ibus_m17n_engine_destroy;
 
@@ -240,6 +687,8 @@ ibus_m17n_engine_class_init (IBusM17NEngineClass *klass)
 
     engine_class->set_content_type = ibus_m17n_engine_set_content_type;
 
+    engine_class->set_surrounding_text = ibus_m17n_engine_set_surrounding_text;
+
     if (!ibus_m17n_scan_class_name (G_OBJECT_CLASS_NAME (klass),
                                     &lang, &name)) {
         g_free (lang);
@@ -306,6 +755,8 @@ ibus_m17n_engine_class_init (IBusM17NEngineClass *klass)
     klass->preedit_focus_mode = IBUS_ENGINE_PREEDIT_COMMIT;
     klass->lookup_table_orientation = IBUS_ORIENTATION_SYSTEM;
     klass->use_us_layout = FALSE;
+    klass->reference_keymap =
+        ibus_m17n_keymap_table_get (engine_config->reference_layout);
 
     ibus_m17n_engine_config_free (engine_config);
 
@@ -354,7 +805,84 @@ ibus_m17n_engine_class_init (IBusM17NEngineClass *klass)
                       G_CALLBACK(ibus_m17n_config_value_changed),
                       klass);
 
+    klass->status_labels = g_hash_table_new_full (g_str_hash,
+                                                  g_str_equal,
+                                                  g_free,
+                                                  g_object_unref);
+
     klass->im = NULL;
+    g_queue_init (&klass->context_pool);
+}
+
+static IBusText *
+ibus_m17n_engine_class_get_status_label (IBusM17NEngineClass *klass,
+                                         const gchar         *status)
+{
+    IBusText *label;
+
+    label = g_hash_table_lookup (klass->status_labels, status);
+    if (label != NULL)
+        return label;
+
+    label = ibus_text_new_from_string (status);
+    /* Some IMs put variable text into the status, do not let the
+       cache grow without bound. */
+    if (g_hash_table_size (klass->status_labels) < STATUS_LABELS_CACHE_SIZE) {
+        g_object_ref_sink (label);
+        g_hash_table_insert (klass->status_labels, g_strdup (status), label);
+    }
+    return label;
+}
+
+static void
+ibus_m17n_engine_class_clear_preedit_attrs (IBusM17NEngineClass *klass)
+{
+    guint i;
+
+    for (i = 0; i < PREEDIT_ATTRS_CACHE_SIZE; i++) {
+        if (klass->preedit_attrs[i]) {
+            g_object_unref (klass->preedit_attrs[i]);
+            klass->preedit_attrs[i] = NULL;
+        }
+    }
+}
+
+static IBusAttrList *
+ibus_m17n_engine_class_build_preedit_attrs (IBusM17NEngineClass *klass,
+                                            guint                len)
+{
+    IBusAttrList *attrs = ibus_attr_list_new ();
+
+    if (klass->preedit_foreground != INVALID_COLOR)
+        ibus_attr_list_append (attrs,
+                               ibus_attr_foreground_new (klass->preedit_foreground,
+                                                         0, len));
+    if (klass->preedit_background != INVALID_COLOR)
+        ibus_attr_list_append (attrs,
+                               ibus_attr_background_new (klass->preedit_background,
+                                                         0, len));
+    ibus_attr_list_append (attrs,
+                           ibus_attr_underline_new (klass->preedit_underline,
+                                                    0, len));
+    return attrs;
+}
+
+/* Return the attribute list for a preedit of LEN characters.  Lists
+   for short preedits are built once and rebuilt only after the
+   configuration has changed. */
+static IBusAttrList *
+ibus_m17n_engine_class_get_preedit_attrs (IBusM17NEngineClass *klass,
+                                          guint                len)
+{
+    if (len >= PREEDIT_ATTRS_CACHE_SIZE)
+        return ibus_m17n_engine_class_build_preedit_attrs (klass, len);
+
+    if (klass->preedit_attrs[len] == NULL) {
+        klass->preedit_attrs[len] =
+            ibus_m17n_engine_class_build_preedit_attrs (klass, len);
+        g_object_ref_sink (klass->preedit_attrs[len]);
+    }
+    return klass->preedit_attrs[len];
 }
 
 static void
@@ -392,6 +920,268 @@ ibus_m17n_config_value_changed (GSettings           *gsettings,
         klass->use_us_layout = g_variant_get_boolean (value);
     }
     g_variant_unref (value);
+
+    ibus_m17n_engine_class_clear_preedit_attrs (klass);
+}
+
+/* Add the first keyvals of the sequences in the compose file PATH to
+   compose_initial_keyvals.  Included files are not followed, the
+   system table of the locale is scanned on its own. */
+static void
+ibus_m17n_engine_compose_scan_initial (const gchar *path)
+{
+    gchar *contents, **lines;
+    guint i;
+
+    if (compose_initial_keyvals == NULL ||
+        !g_file_get_contents (path, &contents, NULL, NULL))
+        return;
+
+    lines = g_strsplit (contents, "\n", -1);
+    for (i = 0; lines[i] != NULL; i++) {
+        gchar *start = g_strchug (lines[i]);
+        gchar *end;
+        guint keyval;
+
+        if (*start != '<' || (end = strchr (start, '>')) == NULL)
+            continue;
+        *end = '\0';
+        start++;
+
+        if (start[0] == 'U' && g_ascii_isxdigit (start[1]))
+            keyval = ibus_unicode_to_keyval (g_ascii_strtoull (start + 1, NULL, 16));
+        else
+            keyval = ibus_keyval_from_name (start);
+        if (keyval != IBUS_VoidSymbol && keyval != 0)
+            g_hash_table_add (compose_initial_keyvals, GUINT_TO_POINTER (keyval));
+    }
+    g_strfreev (lines);
+    g_free (contents);
+}
+
+/* Return a locale name in a form to compare, "en_US.UTF-8" and
+   "en_US.utf8" are the same */
+static gchar *
+ibus_m17n_compose_locale_key (const gchar *locale)
+{
+    GString *key = g_string_new (NULL);
+
+    for (; *locale != '\0' && *locale != '@'; locale++) {
+        if (*locale != '-')
+            g_string_append_c (key, g_ascii_tolower (*locale));
+    }
+    return g_string_free (key, FALSE);
+}
+
+/* Return the system compose file of the current locale as listed in
+   the compose.dir of the X11 locale directory, or NULL */
+static gchar *
+ibus_m17n_engine_compose_system_file (void)
+{
+    const gchar *locale = setlocale (LC_CTYPE, NULL);
+    const gchar *localedir = g_getenv ("XLOCALEDIR");
+    gchar *dirfile, *contents, **lines, *key;
+    gchar *path = NULL;
+    guint i;
+
+    if (locale == NULL)
+        return NULL;
+    if (localedir == NULL)
+        localedir = "/usr/share/X11/locale";
+
+    dirfile = g_build_filename (localedir, "compose.dir", NULL);
+    if (!g_file_get_contents (dirfile, &contents, NULL, NULL)) {
+        g_free (dirfile);
+        return NULL;
+    }
+    g_free (dirfile);
+
+    /* FILE: LOCALE */
+    key = ibus_m17n_compose_locale_key (locale);
+    lines = g_strsplit (contents, "\n", -1);
+    for (i = 0; lines[i] != NULL && path == NULL; i++) {
+        gchar *colon = strchr (lines[i], ':');
+        gchar *other;
+
+        if (lines[i][0] == '#' || colon == NULL)
+            continue;
+        *colon = '\0';
+        other = ibus_m17n_compose_locale_key (g_strstrip (colon + 1));
+        if (strcmp (other, key) == 0)
+            path = g_build_filename (localedir, g_strstrip (lines[i]), NULL);
+        g_free (other);
+    }
+    g_strfreev (lines);
+    g_free (contents);
+    g_free (key);
+
+    return path;
+}
+
+/* Whether IBusEngineSimple may start a sequence with the key */
+static gboolean
+ibus_m17n_engine_compose_is_initial (guint keyval,
+                                     guint modifiers)
+{
+    if (modifiers & IBUS_RELEASE_MASK)
+        return FALSE;
+
+    /* Without the system table any key might start a sequence. */
+    if (compose_initial_keyvals == NULL)
+        return TRUE;
+
+    /* dead_grave up to dead_longsolidusoverlay */
+    if (keyval == IBUS_Multi_key || (keyval >= IBUS_dead_grave && keyval <= 0xfe93))
+        return TRUE;
+
+    /* Unicode hex input */
+    if ((keyval == IBUS_u || keyval == IBUS_U) &&
+        (modifiers & (IBUS_CONTROL_MASK | IBUS_SHIFT_MASK)) ==
+        (IBUS_CONTROL_MASK | IBUS_SHIFT_MASK))
+        return TRUE;
+
+    return g_hash_table_contains (compose_initial_keyvals,
+                                  GUINT_TO_POINTER (keyval));
+}
+
+#if IBUS_CHECK_VERSION(1,5,16)
+static void
+ibus_m17n_engine_compose_changed_cb (GFileMonitor      *monitor,
+                                     GFile             *file,
+                                     GFile             *other_file,
+                                     GFileMonitorEvent  event_type,
+                                     gpointer           user_data)
+{
+    gchar *path;
+    guint i;
+
+    if (event_type != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT &&
+        event_type != G_FILE_MONITOR_EVENT_CREATED)
+        return;
+
+    path = g_file_get_path (file);
+    for (i = 0; i < compose_changed->len; i++) {
+        if (g_strcmp0 (g_ptr_array_index (compose_changed, i), path) == 0) {
+            g_free (path);
+            return;
+        }
+    }
+    g_ptr_array_add (compose_changed, path);
+}
+
+static void
+ibus_m17n_engine_compose_monitor (const gchar *path)
+{
+    GFileMonitor *monitor;
+    GFile *file;
+
+    file = g_file_new_for_path (path);
+    monitor = g_file_monitor_file (file, G_FILE_MONITOR_NONE, NULL, NULL);
+    g_object_unref (file);
+    if (monitor == NULL)
+        return;
+
+    g_signal_connect (monitor, "changed",
+                      G_CALLBACK (ibus_m17n_engine_compose_changed_cb),
+                      NULL);
+    g_ptr_array_add (compose_monitors, monitor);
+}
+
+/* IBusEngineSimple remembers compose files by path and never reads a
+   file twice, so a changed file is added again under a name derived
+   from its contents.  The new table takes precedence over the old.
+
+   Reloading only adds: IBusEngineSimple can not drop a table, so the
+   old table stays behind the new one and a sequence removed from the
+   file keeps working until ibus-engine-m17n restarts.  The same goes
+   for the first keyvals in compose_initial_keyvals, which can only
+   cost a needless trip through IBusEngineSimple. */
+static void
+ibus_m17n_engine_reload_compose_file (IBusM17NEngine *m17n,
+                                      const gchar    *path)
+{
+    gchar *contents, *checksum, *dirname, *basename, *snapshot;
+    gsize length;
+
+    if (!g_file_get_contents (path, &contents, &length, NULL))
+        return;
+
+    checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA1,
+                                            (const guchar *) contents,
+                                            length);
+    dirname = g_build_filename (g_get_user_runtime_dir (), "ibus-m17n", NULL);
+    basename = g_strdup_printf ("Compose-%.16s", checksum);
+    snapshot = g_build_filename (dirname, basename, NULL);
+
+    g_mkdir_with_parents (dirname, 0700);
+    ibus_m17n_engine_compose_scan_initial (path);
+    if (g_file_set_contents (snapshot, contents, length, NULL)) {
+        g_debug ("Reloading compose file %s", path);
+        ibus_engine_simple_add_compose_file ((IBusEngineSimple *) m17n,
+                                             snapshot);
+        g_unlink (snapshot);
+    }
+
+    g_free (snapshot);
+    g_free (basename);
+    g_free (dirname);
+    g_free (checksum);
+    g_free (contents);
+}
+#endif  /* IBUS_CHECK_VERSION(1,5,16) */
+
+/* The compose tables of IBusEngineSimple are process-wide, so only
+   the first engine has to load them; later engines only pick up the
+   compose files of the user which changed in the meantime. */
+static void
+ibus_m17n_engine_load_compose_tables (IBusM17NEngine *m17n)
+{
+    guint i;
+
+    if (compose_monitors == NULL) {
+        gchar *paths[4];
+
+        compose_monitors = g_ptr_array_new_with_free_func (g_object_unref);
+        compose_changed = g_ptr_array_new_with_free_func (g_free);
+
+        /* Load $HOME/.XCompose file: */
+        ibus_engine_simple_add_table_by_locale ((IBusEngineSimple *) m17n,
+                                                NULL);
+
+        /* Tables such as the one of am_ET start sequences with
+           ordinary keys. */
+        paths[0] = ibus_m17n_engine_compose_system_file ();
+        if (paths[0] != NULL) {
+            compose_initial_keyvals = g_hash_table_new (NULL, NULL);
+            ibus_m17n_engine_compose_scan_initial (paths[0]);
+            g_free (paths[0]);
+        }
+
+        /* The user files ibus_engine_simple_add_table_by_locale()
+           looks for */
+        paths[0] = g_build_filename (g_get_user_config_dir (),
+                                     "ibus", "Compose", NULL);
+        paths[1] = g_build_filename (g_get_user_config_dir (),
+                                     "gtk-3.0", "Compose", NULL);
+        paths[2] = g_build_filename (g_get_home_dir (), ".XCompose", NULL);
+        paths[3] = NULL;
+        for (i = 0; paths[i] != NULL; i++) {
+            ibus_m17n_engine_compose_scan_initial (paths[i]);
+#if IBUS_CHECK_VERSION(1,5,16)
+            ibus_m17n_engine_compose_monitor (paths[i]);
+#endif  /* IBUS_CHECK_VERSION(1,5,16) */
+            g_free (paths[i]);
+        }
+        return;
+    }
+
+#if IBUS_CHECK_VERSION(1,5,16)
+    for (i = 0; i < compose_changed->len; i++) {
+        ibus_m17n_engine_reload_compose_file (m17n,
+                                              g_ptr_array_index (compose_changed, i));
+    }
+    g_ptr_array_set_size (compose_changed, 0);
+#endif  /* IBUS_CHECK_VERSION(1,5,16) */
 }
 
 static void
@@ -443,74 +1233,513 @@ ibus_m17n_engine_init (IBusM17NEngine *m17n)
     m17n->table = ibus_lookup_table_new (9, 0, TRUE, TRUE);
     g_object_ref_sink (m17n->table);
     m17n->context = NULL;
-    m17n->us_keymap = ibus_keymap_get ("us");
-    /* Load $HOME/.XCompose file: */
-    ibus_engine_simple_add_table_by_locale ((IBusEngineSimple *) m17n, NULL);
+    m17n->scratch = g_string_sized_new (64);
+    m17n->preedit_text = g_string_sized_new (64);
+    m17n->preedit_valid = FALSE;
+    m17n->status_text = g_string_sized_new (64);
+    m17n->status_valid = FALSE;
+    m17n->pending_commit = g_string_sized_new (64);
+    m17n->pending_keys = g_queue_new ();
+    m17n->pending_keys_id = 0;
+    m17n->ic_clean = TRUE;
+    ibus_m17n_engine_load_compose_tables (m17n);
 }
 
-static GObject*
-ibus_m17n_engine_constructor (GType                   type,
-                              guint                   n_construct_params,
-                              GObjectConstructParam  *construct_params)
+/* Bytes allocated from the heap, 0 if it can not be measured */
+static gsize
+ibus_m17n_heap_usage (void)
 {
-    IBusM17NEngine *m17n;
-    GObjectClass *object_class;
-    IBusM17NEngineClass *klass;
-
-    m17n = (IBusM17NEngine *) G_OBJECT_CLASS (parent_class)->constructor (type,
-                                                       n_construct_params,
-                                                       construct_params);
+#ifdef HAVE_MALLINFO2
+    struct mallinfo2 info = mallinfo2 ();
 
-    object_class = G_OBJECT_GET_CLASS (m17n);
-    klass = (IBusM17NEngineClass *) object_class;
-    if (klass->im == NULL) {
-        const gchar *engine_name;
-        gchar *lang = NULL, *name = NULL;
+    return info.uordblks + info.hblkhd;
+#else
+    return 0;
+#endif  /* HAVE_MALLINFO2 */
+}
 
-        engine_name = ibus_engine_get_name ((IBusEngine *) m17n);
-        if (!ibus_m17n_scan_engine_name (engine_name, &lang, &name)) {
-            g_free (lang);
-            g_free (name);
-            return NULL;
+/* Return the keys the input method in FILENAME can consume as a set
+   of MSymbol, or NULL if that is not known */
+static GHashTable *
+ibus_m17n_consumed_keys_new (const gchar *filename)
+{
+    GHashTable *names, *keys;
+    GHashTableIter iter;
+    gpointer name;
+
+    names = ibus_m17n_mim_consumed_keys_load (filename);
+    if (names == NULL)
+        return NULL;
+
+    keys = g_hash_table_new (NULL, NULL);
+    g_hash_table_iter_init (&iter, names);
+    while (g_hash_table_iter_next (&iter, &name, NULL)) {
+        gunichar c = g_utf8_get_char (name);
+
+        g_hash_table_add (keys, msymbol (name));
+        /* Key events name non-ASCII characters by their keysym. */
+        if (c >= 0x80 && *g_utf8_next_char ((const gchar *) name) == '\0') {
+            const gchar *keysym = ibus_keyval_name (ibus_unicode_to_keyval (c));
+
+            if (keysym != NULL)
+                g_hash_table_add (keys, msymbol (keysym));
         }
+    }
+    g_hash_table_destroy (names);
+
+    return keys;
+}
+
+static gboolean
+ibus_m17n_engine_class_open_im (IBusM17NEngineClass *klass,
+                                const gchar         *engine_name)
+{
+    gchar *lang = NULL, *name = NULL;
+    gsize heap_before, heap_after;
 
-        klass->im = minput_open_im (msymbol (lang), msymbol (name), NULL);
+    if (!ibus_m17n_scan_engine_name (engine_name, &lang, &name)) {
         g_free (lang);
         g_free (name);
+        return FALSE;
+    }
 
-        if (klass->im == NULL) {
-            g_warning ("Can not find m17n keymap %s", engine_name);
-            g_object_unref (m17n);
-            return NULL;
-        }
+    heap_before = ibus_m17n_heap_usage ();
+    klass->im = minput_open_im (msymbol (lang), msymbol (name), NULL);
 
-        mplist_put (klass->im->driver.callback_list, Minput_preedit_start, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_preedit_draw, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_preedit_done, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_status_start, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_status_draw, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_status_done, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_candidates_start, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_candidates_draw, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_candidates_done, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_set_spot, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_toggle, ibus_m17n_engine_callback);
-        /*
-          Does not set reset callback, uses the default callback in m17n.
-          mplist_put (klass->im->driver.callback_list, Minput_reset, ibus_m17n_engine_callback);
-        */
-        mplist_put (klass->im->driver.callback_list, Minput_get_surrounding_text, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_delete_surrounding_text, ibus_m17n_engine_callback);
+    if (klass->im != NULL) {
+        gchar *filename = ibus_m17n_mim_find_file (lang, name);
+
+        if (filename != NULL) {
+            if (g_strcmp0 (g_getenv ("IBUS_M17N_DIRECT_MAP"), "0") != 0)
+                klass->direct_map = ibus_m17n_mim_direct_map_load (filename);
+            if (klass->direct_map != NULL)
+                g_debug ("Using a direct map for %s", engine_name);
+            else
+                klass->consumed_keys = ibus_m17n_consumed_keys_new (filename);
+            g_free (filename);
+        }
     }
+    g_free (lang);
+    g_free (name);
 
-    m17n->context = minput_create_ic (klass->im, m17n);
+    if (klass->im == NULL)
+        return FALSE;
 
-    return (GObject *) m17n;
+    /* Only an estimate: the heap counters are process-wide, so the
+       GDBus worker thread allocating or freeing meanwhile shows up
+       here, the first input method is charged for the m17n database
+       caches it fills, and later ones sharing them are charged less.
+       A wrong estimate only closes an idle input method early, which
+       costs reopening it, or keeps it open longer. */
+    heap_after = ibus_m17n_heap_usage ();
+    klass->im_cost = heap_after > heap_before ? heap_after - heap_before : 0;
+    klass->idle_since = g_get_monotonic_time ();
+    g_queue_push_head (&resident_ims, klass);
+    im_opens++;
+
+    mplist_put (klass->im->driver.callback_list, Minput_preedit_start, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_preedit_draw, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_preedit_done, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_status_start, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_status_draw, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_status_done, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_candidates_start, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_candidates_draw, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_candidates_done, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_set_spot, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_toggle, ibus_m17n_engine_callback);
+    /*
+      Does not set reset callback, uses the default callback in m17n.
+      mplist_put (klass->im->driver.callback_list, Minput_reset, ibus_m17n_engine_callback);
+    */
+    mplist_put (klass->im->driver.callback_list, Minput_get_surrounding_text, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_delete_surrounding_text, ibus_m17n_engine_callback);
+
+    return TRUE;
+}
+
+static void
+ibus_m17n_engine_class_drain_contexts (IBusM17NEngineClass *klass)
+{
+    MInputContext *context;
+
+    while ((context = g_queue_pop_head (&klass->context_pool)) != NULL)
+        minput_destroy_ic (context);
+}
+
+static gboolean
+ibus_m17n_engine_trim_context_pools_cb (gpointer user_data)
+{
+    gint64 now = g_get_monotonic_time ();
+    gboolean pending = FALSE;
+    GList *p;
+
+    for (p = resident_ims.head; p != NULL; p = p->next) {
+        IBusM17NEngineClass *klass = (IBusM17NEngineClass *) p->data;
+
+        if (g_queue_is_empty (&klass->context_pool))
+            continue;
+        if (now - klass->context_pool_used >=
+            (gint64) CONTEXT_POOL_IDLE_TIMEOUT * G_USEC_PER_SEC)
+            ibus_m17n_engine_class_drain_contexts (klass);
+        else
+            pending = TRUE;
+    }
+
+    if (pending)
+        return G_SOURCE_CONTINUE;
+
+    context_pool_trim_id = 0;
+    return G_SOURCE_REMOVE;
+}
+
+/* Return a reset input context bound to M17N, reusing a pooled one
+   if possible. */
+static MInputContext *
+ibus_m17n_engine_class_get_context (IBusM17NEngineClass *klass,
+                                    IBusM17NEngine      *m17n)
+{
+    MInputContext *context;
+
+    context = g_queue_pop_head (&klass->context_pool);
+    if (context == NULL)
+        return minput_create_ic (klass->im, m17n);
+
+    klass->context_pool_used = g_get_monotonic_time ();
+    context->arg = m17n;
+    /* minput_create_ic() would have drawn the initial status */
+    m17n->updates |= ENGINE_UPDATE_STATUS_MASK;
+
+    return context;
+}
+
+static void
+ibus_m17n_engine_class_put_context (IBusM17NEngineClass *klass,
+                                    MInputContext       *context)
+{
+    /* The engine is going away, callbacks from the reset must not
+       reach it. */
+    context->arg = NULL;
+
+    if (klass->context_pool.length >= CONTEXT_POOL_SIZE) {
+        minput_destroy_ic (context);
+        return;
+    }
+
+    minput_reset_ic (context);
+    g_queue_push_head (&klass->context_pool, context);
+    klass->context_pool_used = g_get_monotonic_time ();
+
+    if (context_pool_trim_id == 0)
+        context_pool_trim_id =
+            g_timeout_add_seconds (CONTEXT_POOL_IDLE_TIMEOUT,
+                                   ibus_m17n_engine_trim_context_pools_cb,
+                                   NULL);
+}
+
+static void
+ibus_m17n_engine_class_close_im (IBusM17NEngineClass *klass)
+{
+    g_debug ("Closing idle m17n input method %s", klass->engine_name);
+
+    ibus_m17n_engine_class_drain_contexts (klass);
+    if (klass->direct_map != NULL) {
+        ibus_m17n_direct_map_free (klass->direct_map);
+        klass->direct_map = NULL;
+    }
+    if (klass->consumed_keys != NULL) {
+        g_hash_table_destroy (klass->consumed_keys);
+        klass->consumed_keys = NULL;
+    }
+    minput_close_im (klass->im);
+    klass->im = NULL;
+    klass->im_cost = 0;
+    g_queue_remove (&resident_ims, klass);
+    im_evictions++;
+}
+
+static gboolean
+ibus_m17n_engine_evict_ims_cb (gpointer user_data)
+{
+    im_evict_id = 0;
+    ibus_m17n_engine_evict_ims ();
+    return G_SOURCE_REMOVE;
+}
+
+/* Close input methods without input contexts which have been idle
+   for im_idle_timeout seconds, then the least recently used ones
+   while the resident input methods exceed im_memory_budget. */
+static void
+ibus_m17n_engine_evict_ims (void)
+{
+    gint64 now = g_get_monotonic_time ();
+    gint64 timeout = (gint64) im_idle_timeout * G_USEC_PER_SEC;
+    gint64 next_expiry = 0;
+    gsize total_cost = 0;
+    GList *p, *prev;
+
+    for (p = resident_ims.head; p != NULL; p = p->next)
+        total_cost += ((IBusM17NEngineClass *) p->data)->im_cost;
+
+    for (p = resident_ims.tail; p != NULL; p = prev) {
+        IBusM17NEngineClass *klass = (IBusM17NEngineClass *) p->data;
+        gboolean keep, expired, over_budget;
+
+        prev = p->prev;
+        if (klass->n_contexts > 0)
+            continue;
+
+        /* The recently used input methods are the ones prewarmed at
+           startup, only the memory budget closes them. */
+        keep = ibus_m17n_engine_mru_contains (klass->engine_name);
+        expired = timeout > 0 && !keep && now - klass->idle_since >= timeout;
+        over_budget = im_memory_budget > 0 && total_cost > im_memory_budget;
+        if (expired || over_budget) {
+            total_cost -= klass->im_cost;
+            ibus_m17n_engine_class_close_im (klass);
+        }
+        else if (timeout > 0 && !keep &&
+                 (next_expiry == 0 || klass->idle_since + timeout < next_expiry)) {
+            next_expiry = klass->idle_since + timeout;
+        }
+    }
+
+    /* An already scheduled check expires no later than the new one,
+       since idle_since only moves forward. */
+    if (next_expiry != 0 && im_evict_id == 0) {
+        guint seconds = (next_expiry - now + G_USEC_PER_SEC - 1) / G_USEC_PER_SEC;
+
+        im_evict_id = g_timeout_add_seconds (MAX (seconds, 1),
+                                             ibus_m17n_engine_evict_ims_cb,
+                                             NULL);
+    }
+}
+
+void
+ibus_m17n_engine_set_im_limits (guint idle_timeout,
+                                gsize memory_budget)
+{
+    im_idle_timeout = idle_timeout;
+    im_memory_budget = memory_budget;
+}
+
+void
+ibus_m17n_engine_print_im_stats (void)
+{
+    gint64 now = g_get_monotonic_time ();
+    gsize total_cost = 0;
+    GList *p;
+
+    for (p = resident_ims.head; p != NULL; p = p->next) {
+        IBusM17NEngineClass *klass = (IBusM17NEngineClass *) p->data;
+
+        total_cost += klass->im_cost;
+        g_message ("  %s: %u contexts (%u pooled), %" G_GSIZE_FORMAT
+                   " KiB, idle %" G_GINT64_FORMAT " s",
+                   klass->engine_name,
+                   klass->n_contexts,
+                   klass->context_pool.length,
+                   klass->im_cost / 1024,
+                   klass->n_contexts > 0 ? 0 :
+                   (now - klass->idle_since) / G_USEC_PER_SEC);
+    }
+    g_message ("%u input methods resident, %" G_GSIZE_FORMAT " KiB; "
+               "%u opened, %u closed",
+               resident_ims.length,
+               total_cost / 1024,
+               im_opens,
+               im_evictions);
+}
+
+static gchar *
+ibus_m17n_engine_mru_get_filename (void)
+{
+    return g_build_filename (g_get_user_cache_dir (),
+                             "ibus-m17n",
+                             "mru",
+                             NULL);
+}
+
+/* Return the names of the recently used engines, most recent first */
+static GQueue *
+ibus_m17n_engine_mru_get (void)
+{
+    static GQueue *mru = NULL;
+    gchar *filename, *contents, **lines;
+    gint i;
+
+    if (mru != NULL)
+        return mru;
+
+    mru = g_queue_new ();
+
+    filename = ibus_m17n_engine_mru_get_filename ();
+    if (g_file_get_contents (filename, &contents, NULL, NULL)) {
+        lines = g_strsplit (contents, "\n", -1);
+        for (i = 0; lines[i] != NULL && mru->length < MRU_SIZE; i++) {
+            g_strstrip (lines[i]);
+            if (lines[i][0] != '\0')
+                g_queue_push_tail (mru, g_strdup (lines[i]));
+        }
+        g_strfreev (lines);
+        g_free (contents);
+    }
+    g_free (filename);
+
+    return mru;
+}
+
+static gboolean
+ibus_m17n_engine_mru_contains (const gchar *engine_name)
+{
+    return g_queue_find_custom (ibus_m17n_engine_mru_get (),
+                                engine_name,
+                                (GCompareFunc) g_strcmp0) != NULL;
+}
+
+static void
+ibus_m17n_engine_mru_add (const gchar *engine_name)
+{
+    GQueue *mru = ibus_m17n_engine_mru_get ();
+    GString *contents;
+    GList *p;
+    gchar *filename, *dirname;
+
+    if (!g_queue_is_empty (mru) &&
+        g_strcmp0 (g_queue_peek_head (mru), engine_name) == 0)
+        return;
+
+    p = g_queue_find_custom (mru, engine_name, (GCompareFunc) g_strcmp0);
+    if (p != NULL) {
+        g_free (p->data);
+        g_queue_delete_link (mru, p);
+    }
+    g_queue_push_head (mru, g_strdup (engine_name));
+    while (mru->length > MRU_SIZE)
+        g_free (g_queue_pop_tail (mru));
+
+    contents = g_string_new (NULL);
+    for (p = mru->head; p != NULL; p = p->next)
+        g_string_append_printf (contents, "%s\n", (const gchar *) p->data);
+
+    filename = ibus_m17n_engine_mru_get_filename ();
+    dirname = g_path_get_dirname (filename);
+    g_mkdir_with_parents (dirname, 0700);
+    g_file_set_contents (filename, contents->str, contents->len, NULL);
+    g_free (dirname);
+    g_free (filename);
+    g_string_free (contents, TRUE);
+}
+
+static gboolean
+ibus_m17n_engine_prewarm_cb (gpointer user_data)
+{
+    GQueue *engine_names = (GQueue *) user_data;
+    gchar *engine_name;
+
+    /* One input method per call to keep the main loop responsive */
+    engine_name = g_queue_pop_head (engine_names);
+    if (engine_name != NULL) {
+        GType type = ibus_m17n_engine_get_type_for_name (engine_name);
+
+        if (type != G_TYPE_INVALID) {
+            /* Keep the class, it owns the opened input method. */
+            IBusM17NEngineClass *klass = g_type_class_ref (type);
+
+            if (klass->im == NULL) {
+                if (ibus_m17n_engine_class_open_im (klass, engine_name))
+                    ibus_m17n_engine_evict_ims ();
+                else
+                    g_debug ("Can not prewarm %s", engine_name);
+            }
+        }
+        g_free (engine_name);
+    }
+
+    if (!g_queue_is_empty (engine_names))
+        return G_SOURCE_CONTINUE;
+
+    g_queue_free (engine_names);
+    return G_SOURCE_REMOVE;
+}
+
+void
+ibus_m17n_engine_prewarm (void)
+{
+    GQueue *mru = ibus_m17n_engine_mru_get ();
+    GQueue *engine_names;
+    GList *p;
+
+    if (g_queue_is_empty (mru))
+        return;
+
+    engine_names = g_queue_new ();
+    for (p = mru->head; p != NULL; p = p->next)
+        g_queue_push_tail (engine_names, g_strdup (p->data));
+
+    g_idle_add_full (G_PRIORITY_LOW,
+                     ibus_m17n_engine_prewarm_cb,
+                     engine_names,
+                     NULL);
+}
+
+static GObject*
+ibus_m17n_engine_constructor (GType                   type,
+                              guint                   n_construct_params,
+                              GObjectConstructParam  *construct_params)
+{
+    IBusM17NEngine *m17n;
+    GObjectClass *object_class;
+    IBusM17NEngineClass *klass;
+
+    m17n = (IBusM17NEngine *) G_OBJECT_CLASS (parent_class)->constructor (type,
+                                                       n_construct_params,
+                                                       construct_params);
+
+    object_class = G_OBJECT_GET_CLASS (m17n);
+    klass = (IBusM17NEngineClass *) object_class;
+    if (klass->im == NULL) {
+        const gchar *engine_name = ibus_engine_get_name ((IBusEngine *) m17n);
+
+        if (!ibus_m17n_engine_class_open_im (klass, engine_name)) {
+            g_warning ("Can not find m17n keymap %s", engine_name);
+            g_object_unref (m17n);
+            return NULL;
+        }
+    }
+
+    m17n->context = ibus_m17n_engine_class_get_context (klass, m17n);
+    if (m17n->context != NULL) {
+        klass->n_contexts++;
+        /* move to the most recently used end */
+        g_queue_remove (&resident_ims, klass);
+        g_queue_push_head (&resident_ims, klass);
+        ibus_m17n_engine_evict_ims ();
+    }
+
+    return (GObject *) m17n;
 }
 
 static void
 ibus_m17n_engine_destroy (IBusM17NEngine *m17n)
 {
+    if (m17n->pending_keys_id != 0) {
+        g_source_remove (m17n->pending_keys_id);
+        m17n->pending_keys_id = 0;
+    }
+
+    /* The client may go away right after a burst of key events. */
+    ibus_m17n_engine_flush_commit (m17n);
+    if (m17n->flush_id != 0) {
+        g_source_remove (m17n->flush_id);
+        m17n->flush_id = 0;
+    }
+
+    if (m17n->pending_keys) {
+        g_queue_free_full (m17n->pending_keys, ibus_m17n_key_event_free);
+        m17n->pending_keys = NULL;
+    }
+
     if (m17n->prop_list) {
         g_object_unref (m17n->prop_list);
         m17n->prop_list = NULL;
@@ -533,72 +1762,134 @@ ibus_m17n_engine_destroy (IBusM17NEngine *m17n)
         m17n->table = NULL;
     }
 
+
     if (m17n->context) {
-        minput_destroy_ic (m17n->context);
+        IBusM17NEngineClass *klass =
+            (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+
+        ibus_m17n_engine_class_put_context (klass, m17n->context);
         m17n->context = NULL;
+
+        if (--klass->n_contexts == 0) {
+            klass->idle_since = g_get_monotonic_time ();
+            ibus_m17n_engine_evict_ims ();
+        }
     }
 
-    if (m17n->us_keymap) {
-        g_object_unref (m17n->us_keymap);
-        m17n->us_keymap = NULL;
+    ibus_m17n_engine_clear_candidates (m17n);
+
+    if (m17n->scratch) {
+        g_string_free (m17n->scratch, TRUE);
+        m17n->scratch = NULL;
     }
 
+    if (m17n->preedit_text) {
+        g_string_free (m17n->preedit_text, TRUE);
+        m17n->preedit_text = NULL;
+    }
+
+    if (m17n->status_text) {
+        g_string_free (m17n->status_text, TRUE);
+        m17n->status_text = NULL;
+    }
+
+    if (m17n->pending_commit) {
+        g_string_free (m17n->pending_commit, TRUE);
+        m17n->pending_commit = NULL;
+    }
+
+    ibus_m17n_engine_clear_surrounding (m17n);
+
     IBUS_OBJECT_CLASS (parent_class)->destroy ((IBusObject *)m17n);
 }
 
+/* Send a preedit to the client unless it is exactly what the client
+   already has. */
 static void
-ibus_m17n_engine_update_preedit (IBusM17NEngine *m17n)
+ibus_m17n_engine_send_preedit (IBusM17NEngine *m17n,
+                               const gchar    *string,
+                               guint           cursor_pos,
+                               gboolean        visible)
 {
     IBusText *text;
-    gchar *buf;
     IBusM17NEngineClass *klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
 
-    if (!mtext_len (m17n->context->preedit)) {
-        /* Do not update the preedit if it has length 0 to avoid flicker */
+    if (m17n->preedit_valid &&
+        m17n->preedit_visible == visible &&
+        m17n->preedit_cursor == cursor_pos &&
+        strcmp (m17n->preedit_text->str, string) == 0)
         return;
-    }
-    buf = ibus_m17n_mtext_to_utf8 (m17n->context->preedit);
-    if (buf) {
-        text = ibus_text_new_from_string (buf);
-        if (klass->preedit_foreground != INVALID_COLOR)
-            ibus_text_append_attribute (text, IBUS_ATTR_TYPE_FOREGROUND,
-                                        klass->preedit_foreground, 0, -1);
-        if (klass->preedit_background != INVALID_COLOR)
-            ibus_text_append_attribute (text, IBUS_ATTR_TYPE_BACKGROUND,
-                                        klass->preedit_background, 0, -1);
-        ibus_text_append_attribute (text, IBUS_ATTR_TYPE_UNDERLINE,
-                                    klass->preedit_underline, 0, -1);
-        ibus_engine_update_preedit_text_with_mode ((IBusEngine *) m17n,
-                                                   text,
-                                                   m17n->context->cursor_pos,
-                                                   TRUE,
-                                                   klass->preedit_focus_mode);
-    }
-    g_free (buf);
+
+    g_string_assign (m17n->preedit_text, string);
+    m17n->preedit_cursor = cursor_pos;
+    m17n->preedit_visible = visible;
+    m17n->preedit_valid = TRUE;
+
+    text = ibus_text_new_from_string (string);
+    if (*string)
+        ibus_text_set_attributes (text,
+            ibus_m17n_engine_class_get_preedit_attrs (klass,
+                ibus_text_get_length (text)));
+    ibus_engine_update_preedit_text_with_mode ((IBusEngine *) m17n,
+                                               text,
+                                               cursor_pos,
+                                               visible,
+                                               klass->preedit_focus_mode);
 }
 
 static void
-ibus_m17n_engine_hide_preedit_if_empty (IBusM17NEngine *m17n)
+ibus_m17n_engine_update_preedit (IBusM17NEngine *m17n)
 {
-    IBusM17NEngineClass *klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
-    if (mtext_len (m17n->context->preedit)) {
+    IBusM17NEngineClass *klass =
+        (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+    GString *buf = m17n->scratch;
+
+    if (klass->direct_map != NULL) {
+        const gchar *preedit;
+
+        if (m17n->direct_node == IBUS_M17N_DIRECT_MAP_ROOT) {
+            ibus_m17n_engine_send_preedit (m17n, "", 0, FALSE);
+            return;
+        }
+        preedit = ibus_m17n_direct_map_get_output (klass->direct_map,
+                                                   m17n->direct_node);
+        ibus_m17n_engine_send_preedit (m17n,
+                                       preedit,
+                                       g_utf8_strlen (preedit, -1),
+                                       TRUE);
         return;
     }
-    ibus_engine_update_preedit_text_with_mode (
-        (IBusEngine *) m17n,
-        ibus_text_new_from_string (""),
-        0,
-        FALSE,
-        klass->preedit_focus_mode);
+
+    if (!mtext_len (m17n->context->preedit)) {
+        ibus_m17n_engine_send_preedit (m17n, "", 0, FALSE);
+        return;
+    }
+    g_string_truncate (buf, 0);
+    ibus_m17n_mtext_append_utf8 (buf, m17n->context->preedit);
+    ibus_m17n_engine_send_preedit (m17n,
+                                   buf->str,
+                                   m17n->context->cursor_pos,
+                                   TRUE);
 }
 
 static void
 ibus_m17n_engine_commit_string (IBusM17NEngine *m17n,
                                 const gchar    *string)
 {
+    IBusM17NEngineClass *klass =
+        (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
     IBusText *text;
-    text = ibus_text_new_from_string (string);
-    ibus_engine_commit_text ((IBusEngine *)m17n, text);
+    gint64 start = ibus_m17n_trace_now ();
+
+    if (m17n->in_burst) {
+        g_string_append (m17n->pending_commit, string);
+    }
+    else {
+        text = ibus_text_new_from_string (string);
+        ibus_engine_commit_text ((IBusEngine *)m17n, text);
+        IBUS_M17N_TRACE (IBUS_M17N_TRACE_COMMIT, start, klass->engine_name, NULL);
+    }
+    ibus_m17n_engine_clear_surrounding (m17n);
     /*
       Updating the preedit after commit is necessary because some
       applications (OpenOffice.org or Evolution) expect that
@@ -613,7 +1904,8 @@ ibus_m17n_engine_commit_string (IBusM17NEngine *m17n,
       You won't see the n+1’th character in the preedit buffer updating
       the preedit after commit.
     */
-    ibus_m17n_engine_update_preedit (m17n);
+    m17n->preedit_valid = FALSE;
+    m17n->updates |= ENGINE_UPDATE_PREEDIT_MASK;
 }
 
 /* Note on AltGr (Level3 Shift) handling: While currently we expect
@@ -637,125 +1929,146 @@ ibus_m17n_key_event_to_symbol (IBusM17NEngine *m17n,
                                guint           keyval,
                                guint           modifiers)
 {
-    GString *keysym;
-    MSymbol mkeysym = Mnil;
-    guint mask = 0;
-
     if (keyval >= IBUS_Shift_L && keyval <= IBUS_Hyper_R) {
         return Mnil;
     }
 
     /* If keyval is already translated by IBUS_MOD5_MASK.  Try to
-       obtain the untranslated keyval from the US keymap. */
+       obtain the untranslated keyval from the reference keymap. */
     if (modifiers & IBUS_MOD5_MASK) {
-        keyval = ibus_keymap_lookup_keysym (m17n->us_keymap,
-                                            keycode,
-                                            modifiers & ~IBUS_MOD5_MASK);
-    }
-
-    keysym = g_string_new ("");
+        IBusM17NEngineClass *klass =
+            (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
 
-    if (keyval >= IBUS_space && keyval <= IBUS_asciitilde) {
-        gint c = keyval;
+        keyval = ibus_m17n_keymap_table_lookup (klass->reference_keymap,
+                                                keycode,
+                                                modifiers & ~IBUS_MOD5_MASK);
+    }
 
-        if (keyval == IBUS_space && modifiers & IBUS_SHIFT_MASK)
-            mask |= IBUS_SHIFT_MASK;
+    return ibus_m17n_key_table_lookup (keyval, modifiers);
+}
 
-        if (modifiers & IBUS_CONTROL_MASK) {
-            if (c >= IBUS_a && c <= IBUS_z)
-                c += IBUS_A - IBUS_a;
-            mask |= IBUS_CONTROL_MASK;
-        }
+static void
+ibus_m17n_engine_reset_ic (IBusM17NEngine *m17n)
+{
+    minput_reset_ic (m17n->context);
+    m17n->direct_node = IBUS_M17N_DIRECT_MAP_ROOT;
+    m17n->ic_clean = TRUE;
+}
 
-        g_string_append_c (keysym, c);
+/* Process KEY with the direct map of the class as minput_filter()
+   and minput_lookup() would with the input method.  Return 1 if the
+   key only changed the preedit, 0 if it was handled and the text in
+   BUF is to be committed, and -1 if it was not handled, after
+   committing the text in BUF if any. */
+static gint
+ibus_m17n_engine_direct_filter (IBusM17NEngine *m17n,
+                                MSymbol         key,
+                                GString        *buf)
+{
+    IBusM17NEngineClass *klass =
+        (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+    const IBusM17NDirectMap *map = klass->direct_map;
+    const gchar *name;
+    gint node;
+
+    if (key == Minput_focus_in)
+        return 1;
+
+    name = msymbol_name (key);
+    node = ibus_m17n_direct_map_step (map, m17n->direct_node, name);
+    if (node < 0 && m17n->direct_node != IBUS_M17N_DIRECT_MAP_ROOT) {
+        /* The sequence can not continue, commit it and start over. */
+        g_string_append (buf, ibus_m17n_direct_map_get_output (map,
+                                                               m17n->direct_node));
+        m17n->direct_node = IBUS_M17N_DIRECT_MAP_ROOT;
+        node = ibus_m17n_direct_map_step (map, m17n->direct_node, name);
     }
-    else {
-        const gchar *name = ibus_keyval_name (keyval);
-        if (name == NULL) {
-            g_string_free (keysym, TRUE);
-            return Mnil;
-        }
-        g_string_append (keysym, name);
-        mask |= modifiers & IBUS_CONTROL_MASK;
-        if (modifiers & IBUS_SHIFT_MASK) {
-            const gunichar unicode = ibus_keyval_to_unicode (keyval);
-            if (!g_unichar_isgraph(unicode)) {
-                /*
-                  https://github.com/ibus/ibus-m17n/issues/90
-                  Add IBUS_SHIFT_MASK only if the unicode character is not “graph”,
-                  that means it is either a space or not printable.
-                  Do not add it for other characters, for example if Shift+ü has
-                  been typed, the keysym is “Udiaeresis” and the Shift has been
-                  absorbed in the uppercase, adding IBUS_SHIFT_MASK would result
-                  in the msymbol “S-Udiaeresis”, which would be wrong.
-                 */
-                mask |= IBUS_SHIFT_MASK;
-            }
-        }
+    if (node < 0)
+        return -1;
+
+    if (ibus_m17n_direct_map_is_leaf (map, node)) {
+        g_string_append (buf, ibus_m17n_direct_map_get_output (map, node));
+        m17n->direct_node = IBUS_M17N_DIRECT_MAP_ROOT;
+        return 0;
     }
 
-    mask |= modifiers & (IBUS_MOD1_MASK |
-                         IBUS_MOD5_MASK |
-                         IBUS_META_MASK |
-                         IBUS_SUPER_MASK |
-                         IBUS_HYPER_MASK);
+    m17n->direct_node = node;
+    return buf->len > 0 ? 0 : 1;
+}
 
+/* Return FALSE if KEY can only be passed through by the input method,
+   so that shortcuts of the application need not go through m17n.
+   Keys outside the maps still end a pending preedit or select
+   candidates. */
+static gboolean
+ibus_m17n_engine_may_consume_key (IBusM17NEngine *m17n,
+                                  MSymbol         key)
+{
+    IBusM17NEngineClass *klass =
+        (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
 
-    if (mask & IBUS_HYPER_MASK) {
-        g_string_prepend (keysym, "H-");
-    }
-    if (mask & IBUS_SUPER_MASK) {
-        g_string_prepend (keysym, "s-");
-    }
-    if (mask & IBUS_MOD5_MASK) {
-        g_string_prepend (keysym, "G-");
-    }
-    if (mask & IBUS_MOD1_MASK) {
-        g_string_prepend (keysym, "A-");
-    }
-    if (mask & IBUS_META_MASK) {
-        g_string_prepend (keysym, "M-");
-    }
-    if (mask & IBUS_CONTROL_MASK) {
-        g_string_prepend (keysym, "C-");
-    }
-    if (mask & IBUS_SHIFT_MASK) {
-        g_string_prepend (keysym, "S-");
-    }
-    mkeysym = msymbol (keysym->str);
-    g_string_free (keysym, TRUE);
+    if (klass->consumed_keys == NULL ||
+        mtext_len (m17n->context->preedit) > 0 ||
+        m17n->context->candidate_list != NULL)
+        return TRUE;
 
-    return mkeysym;
+    return g_hash_table_contains (klass->consumed_keys, key);
 }
 
 static gboolean
 ibus_m17n_engine_process_key (IBusM17NEngine *m17n,
                               MSymbol         key)
 {
-    gchar *buf;
+    IBusM17NEngineClass *klass =
+        (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+    GString *buf = m17n->scratch;
     MText *produced;
     gint retval;
     gchar *sym_name = msymbol_name (key);
+    const gchar *trace_key = ibus_m17n_engine_trace_key (m17n, key);
+    gint64 start;
 
-    retval = minput_filter (m17n->context, key, NULL);
+    m17n->ic_clean = FALSE;
 
-    if (retval) {
-        ibus_m17n_engine_hide_preedit_if_empty (m17n);
-        return TRUE;
+    if (klass->direct_map != NULL) {
+        start = ibus_m17n_trace_now ();
+        g_string_truncate (buf, 0);
+        retval = ibus_m17n_engine_direct_filter (m17n, key, buf);
+        IBUS_M17N_TRACE (IBUS_M17N_TRACE_FILTER, start, klass->engine_name, trace_key);
+
+        if (retval > 0) {
+            m17n->updates |= ENGINE_UPDATE_PREEDIT_MASK;
+            return TRUE;
+        }
     }
+    else {
+        start = ibus_m17n_trace_now ();
+        retval = minput_filter (m17n->context, key, NULL);
+        IBUS_M17N_TRACE (IBUS_M17N_TRACE_FILTER, start, klass->engine_name, trace_key);
 
-    produced = mtext ();
+        if (retval) {
+            m17n->updates |= ENGINE_UPDATE_PREEDIT_MASK;
+            return TRUE;
+        }
 
-    retval = minput_lookup (m17n->context, key, NULL, produced);
+        produced = mtext ();
 
-    if (retval) {
-        // g_debug ("minput_lookup returns %d", retval);
-    }
+        start = ibus_m17n_trace_now ();
+        retval = minput_lookup (m17n->context, key, NULL, produced);
+        IBUS_M17N_TRACE (IBUS_M17N_TRACE_LOOKUP, start, klass->engine_name, trace_key);
 
-    buf = ibus_m17n_mtext_to_utf8 (produced);
-    m17n_object_unref (produced);
+        if (retval) {
+            // g_debug ("minput_lookup returns %d", retval);
+        }
+
+        start = ibus_m17n_trace_now ();
+        g_string_truncate (buf, 0);
+        ibus_m17n_mtext_append_utf8 (buf, produced);
+        m17n_object_unref (produced);
+        IBUS_M17N_TRACE (IBUS_M17N_TRACE_CONVERT, start, klass->engine_name, NULL);
+    }
 
-    if (retval && buf && strlen (buf)) {
+    if (retval && buf->len) {
         /*
           Prefer commit to "return FALSE;" for space and other
           keys where the msymbol name is exactly one character to
@@ -769,51 +2082,135 @@ ibus_m17n_engine_process_key (IBusM17NEngine *m17n,
           example Control+a has the msymbol name "C-a") and it should
           exclude all control characters like Return and Tab.
         */
-        gchar *commit_string = NULL;
-        if (strlen (sym_name) == 1) {
-            commit_string = g_strconcat (buf, sym_name, NULL);
+        const gchar *suffix = NULL;
+        if (sym_name[0] != '\0' && sym_name[1] == '\0') {
+            suffix = sym_name;
         }
         else if (g_strcmp0 (sym_name, "KP_Space") == 0) {
-            commit_string = g_strconcat (buf, " ", NULL);
+            suffix = " ";
         }
-        if (commit_string) {
-            ibus_m17n_engine_commit_string (m17n, commit_string);
-            g_free (commit_string);
-            g_free (buf);
-            ibus_m17n_engine_hide_preedit_if_empty (m17n);
+        if (suffix) {
+            g_string_append (buf, suffix);
+            ibus_m17n_engine_commit_string (m17n, buf->str);
+            m17n->updates |= ENGINE_UPDATE_PREEDIT_MASK;
             return TRUE;
         }
     }
 
-    if (buf && strlen (buf)) {
-        ibus_m17n_engine_commit_string (m17n, buf);
+    if (buf->len) {
+        ibus_m17n_engine_commit_string (m17n, buf->str);
     }
 
-    ibus_m17n_engine_hide_preedit_if_empty (m17n);
+    m17n->updates |= ENGINE_UPDATE_PREEDIT_MASK;
 
-    if (retval && buf && strlen (buf)) {
+    if (retval && buf->len) {
         /*
           We have a key event here which caused a commit
           but handling it by appending to the commit string
           was not possible (For example Return or KP_Enter
           or keys where modifiers were pressed).
 
-          But a sleep of 0.1 seconds between the commit and passing
-          through that key event helps Mutter to guess which actions
-          belong together and get the order right. So this mostly
-          "fixes" the problem as well.  A sleep is not so nice, but as
-          these key events are rare that sleep should not hurt much.
+          Passing the key event through right away lets Mutter
+          handle it before the commit, see:
+          https://github.com/ibus/ibus-m17n/issues/72
+          So ask the caller to consume the key event and forward it
+          to the client after the commit instead, see
+          ibus_m17n_engine_queue_key_event().
         */
-        struct timespec delay;
-        delay.tv_sec = 0;
-        delay.tv_nsec = 100000000; // 100,000,000 nanoseconds = 0.1 seconds
-        nanosleep (&delay, NULL);
+        m17n->forward_after_commit = TRUE;
     }
-    g_free (buf);
-
     return retval == 0;
 }
 
+static void
+ibus_m17n_key_event_free (gpointer data)
+{
+    g_slice_free (IBusM17NKeyEvent, data);
+}
+
+static void
+ibus_m17n_engine_queue_key_event (IBusM17NEngine *m17n,
+                                  guint           keyval,
+                                  guint           keycode,
+                                  guint           modifiers,
+                                  gboolean        forward)
+{
+    IBusM17NKeyEvent *event = g_slice_new (IBusM17NKeyEvent);
+
+    event->keyval = keyval;
+    event->keycode = keycode;
+    event->modifiers = modifiers;
+    event->forward = forward;
+
+    if (forward) {
+        /* A key event forwarded after a commit must be released
+           before the key events which arrived while it was pending,
+           see ibus_m17n_engine_release_pending_keys(). */
+        g_queue_push_head (m17n->pending_keys, event);
+        if (m17n->pending_keys_id == 0)
+            m17n->pending_keys_id =
+                g_timeout_add (FORWARD_KEY_DELAY,
+                               ibus_m17n_engine_release_pending_keys_cb,
+                               m17n);
+    }
+    else {
+        g_queue_push_tail (m17n->pending_keys, event);
+    }
+}
+
+static void
+ibus_m17n_engine_release_pending_keys (IBusM17NEngine *m17n,
+                                       gboolean        immediate)
+{
+    IBusM17NEngineClass *klass =
+        (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+    IBusM17NKeyEvent *event;
+
+    while ((event = g_queue_pop_head (m17n->pending_keys)) != NULL) {
+        gboolean handled = FALSE;
+        gint64 start;
+
+        if (!event->forward) {
+            handled = ibus_m17n_engine_filter_key_event (m17n,
+                                                         event->keyval,
+                                                         event->keycode,
+                                                         event->modifiers);
+            ibus_m17n_engine_flush_updates (m17n);
+        }
+        if (!handled) {
+            start = ibus_m17n_trace_now ();
+            ibus_engine_forward_key_event ((IBusEngine *) m17n,
+                                           event->keyval,
+                                           event->keycode,
+                                           event->modifiers);
+            IBUS_M17N_TRACE (IBUS_M17N_TRACE_FORWARD, start,
+                             klass->engine_name, NULL);
+        }
+        ibus_m17n_key_event_free (event);
+
+        /* The key event has caused another commit followed by a
+           forward, wait for the next timeout. */
+        if (m17n->pending_keys_id != 0 && !immediate)
+            return;
+    }
+
+    if (m17n->pending_keys_id != 0) {
+        g_source_remove (m17n->pending_keys_id);
+        m17n->pending_keys_id = 0;
+    }
+}
+
+static gboolean
+ibus_m17n_engine_release_pending_keys_cb (gpointer user_data)
+{
+    IBusM17NEngine *m17n = (IBusM17NEngine *) user_data;
+
+    m17n->pending_keys_id = 0;
+    ibus_m17n_engine_release_pending_keys (m17n, FALSE);
+
+    return G_SOURCE_REMOVE;
+}
+
 static gboolean
 ibus_m17n_engine_process_key_event (IBusEngine     *engine,
                                     guint           keyval,
@@ -821,9 +2218,61 @@ ibus_m17n_engine_process_key_event (IBusEngine     *engine,
                                     guint           modifiers)
 {
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
+    IBusM17NEngineClass *klass =
+        (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+    gint64 start = ibus_m17n_trace_now ();
+    gboolean retval;
+
+    /* Keep the order of key events while a forwarded key event is
+       pending. */
+    if (!g_queue_is_empty (m17n->pending_keys)) {
+        ibus_m17n_engine_queue_key_event (m17n, keyval, keycode, modifiers, FALSE);
+        return TRUE;
+    }
+
+    /* While more key events wait to be dispatched, the commits and
+       updates are sent once by an idle callback, which runs when none
+       is left.  Releases do not reach the application as text, they
+       keep a burst going. */
+    if (klass->uses_surrounding)
+        m17n->in_burst = FALSE;
+    else if (modifiers & IBUS_RELEASE_MASK)
+        m17n->in_burst = m17n->flush_id != 0;
+    else
+        m17n->in_burst = g_main_context_pending (NULL);
+
+    retval = ibus_m17n_engine_filter_key_event (m17n, keyval, keycode, modifiers);
+
+    /* A key passed to the application or forwarded later must come
+       after the text committed before it. */
+    if (m17n->in_burst &&
+        (retval || (modifiers & IBUS_RELEASE_MASK)) &&
+        g_queue_is_empty (m17n->pending_keys)) {
+        if (m17n->flush_id == 0)
+            m17n->flush_id = g_idle_add (ibus_m17n_engine_flush_updates_cb, m17n);
+    }
+    else {
+        ibus_m17n_engine_flush_updates (m17n);
+    }
+    m17n->in_burst = FALSE;
+
+    IBUS_M17N_TRACE (IBUS_M17N_TRACE_KEY_EVENT, start, klass->engine_name, NULL);
+
+    return retval;
+}
+
+static gboolean
+ibus_m17n_engine_filter_key_event (IBusM17NEngine *m17n,
+                                   guint           keyval,
+                                   guint           keycode,
+                                   guint           modifiers)
+{
+    IBusEngine *engine = (IBusEngine *) m17n;
     IBusM17NEngineClass *klass =
         (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
     guint original_keyval = keyval;
+    gboolean handled;
+    gint64 start;
 
     switch (m17n->purpose) {
     case IBUS_INPUT_PURPOSE_PASSWORD:
@@ -837,7 +2286,7 @@ ibus_m17n_engine_process_key_event (IBusEngine     *engine,
     }
 
     if (klass->use_us_layout) {
-        if (g_strcmp0 (ibus_keyval_name (keyval), "Multi_key") != 0) {
+        if (keyval != IBUS_Multi_key) {
             /*
               Do not translate the Multi_key: If the non-US layout has
               a Multi_key, trying to translate it to US layout just
@@ -845,9 +2294,9 @@ ibus_m17n_engine_process_key_event (IBusEngine     *engine,
               Multi_key around which is more useful, it can still be
               used for Compose then.
              */
-            keyval = ibus_keymap_lookup_keysym (m17n->us_keymap,
-                                                keycode,
-                                                modifiers);
+            keyval = ibus_m17n_keymap_table_lookup (klass->reference_keymap,
+                                                    keycode,
+                                                    modifiers);
         }
     }
 
@@ -857,30 +2306,58 @@ ibus_m17n_engine_process_key_event (IBusEngine     *engine,
       IBusM17NEngine inherits from
       IBusEngineSimple. IBUS_ENGINE_CLASS(parent_class)->process_key_event()
       calls ibus_engine_simple_process_key_event(). This will handle compose sequences.
+
+      Keys which can neither continue nor start a sequence skip it.
     */
-    if (IBUS_ENGINE_CLASS (parent_class)->process_key_event (engine, keyval, keycode, modifiers)) {
-        if (mtext_len (m17n->context->preedit) > 0) {
-            gchar *buf;
-            buf = ibus_m17n_mtext_to_utf8 (m17n->context->preedit);
-            if (buf) {
+    if (m17n->compose_active ||
+        ibus_m17n_engine_compose_is_initial (keyval, modifiers)) {
+        /* IBusEngineSimple commits by itself */
+        ibus_m17n_engine_flush_commit (m17n);
+
+        start = ibus_m17n_trace_now ();
+        handled = IBUS_ENGINE_CLASS (parent_class)->process_key_event (engine, keyval, keycode, modifiers);
+        IBUS_M17N_TRACE (IBUS_M17N_TRACE_COMPOSE, start, klass->engine_name, NULL);
+
+        /* A consumed key press starts or continues a sequence, any
+           other key press ends it. */
+        if (!(modifiers & IBUS_RELEASE_MASK))
+            m17n->compose_active = handled;
+
+        if (handled) {
+            if (mtext_len (m17n->context->preedit) > 0) {
                 IBusText *text;
-                text = ibus_text_new_from_string (buf);
-                ibus_engine_commit_text (engine, text);
-                g_free (buf);
+                text = ibus_m17n_text_new_from_mtext (m17n->context->preedit);
+                if (text)
+                    ibus_engine_commit_text (engine, text);
+                ibus_m17n_engine_clear_surrounding (m17n);
+                m17n->preedit_valid = FALSE;
+                ibus_m17n_engine_reset_ic (m17n);
             }
-            minput_reset_ic (m17n->context);
+            else if (m17n->direct_node != IBUS_M17N_DIRECT_MAP_ROOT) {
+                ibus_m17n_engine_commit_string (m17n,
+                    ibus_m17n_direct_map_get_output (klass->direct_map,
+                                                     m17n->direct_node));
+                ibus_m17n_engine_reset_ic (m17n);
+            }
+            return TRUE;
         }
-        return TRUE;
     }
 
     if (modifiers & IBUS_RELEASE_MASK)
         return FALSE;
 
+    m17n->forward_after_commit = FALSE;
+
+    start = ibus_m17n_trace_now ();
     MSymbol m17n_key = ibus_m17n_key_event_to_symbol (m17n,
                                                       keycode,
                                                       keyval,
                                                       modifiers);
-    if (m17n_key != Mnil && ibus_m17n_engine_process_key (m17n, m17n_key)) {
+    IBUS_M17N_TRACE (IBUS_M17N_TRACE_KEY_TO_SYMBOL, start, klass->engine_name,
+                     ibus_m17n_engine_trace_key (m17n, m17n_key));
+    if (m17n_key != Mnil &&
+        ibus_m17n_engine_may_consume_key (m17n, m17n_key) &&
+        ibus_m17n_engine_process_key (m17n, m17n_key)) {
         return TRUE;
     }
 
@@ -894,6 +2371,11 @@ ibus_m17n_engine_process_key_event (IBusEngine     *engine,
         return TRUE;
     }
 
+    if (m17n->forward_after_commit) {
+        ibus_m17n_engine_queue_key_event (m17n, original_keyval, keycode, modifiers, TRUE);
+        return TRUE;
+    }
+
     return FALSE;
 }
 
@@ -902,8 +2384,24 @@ ibus_m17n_engine_focus_in (IBusEngine *engine)
 {
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
+    /* The client may have dropped the preedit and the lookup table
+       while unfocused. */
+    m17n->preedit_valid = FALSE;
+    m17n->lookup_table_visible = FALSE;
+    m17n->candidate_page = 0;
+
+    ibus_m17n_engine_load_compose_tables (m17n);
+
+    m17n->has_focus = TRUE;
+    /* Other engines, engine processes or windows may have replaced
+       the properties of the panel while unfocused, which this process
+       can not observe, so they are always registered again.  Only
+       ibus_m17n_engine_update_status() skips unchanged properties. */
     ibus_engine_register_properties (engine, m17n->prop_list);
-    ibus_m17n_engine_process_key (m17n, Minput_focus_in);
+    /* A reset context has nothing to restore */
+    if (!m17n->ic_clean)
+        ibus_m17n_engine_process_key (m17n, Minput_focus_in);
+    ibus_m17n_engine_flush_updates (m17n);
 
     IBUS_ENGINE_CLASS (parent_class)->focus_in (engine);
 }
@@ -913,11 +2411,26 @@ ibus_m17n_engine_focus_out (IBusEngine *engine)
 {
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
+    /* Text of a burst and the keys queued behind a commit belong to
+       the client losing the focus, they must reach it before the
+       focus moves.  The commit is sent first and the client receives
+       the signals of the engine in order, the forward is only not
+       delayed for clients processing the commit asynchronously. */
+    ibus_m17n_engine_flush_commit (m17n);
+    ibus_m17n_engine_release_pending_keys (m17n, TRUE);
+
+    m17n->has_focus = FALSE;
+
     /* To make ibus_engine_update_preedit_text_with_mode work
        properly, we just reset the IC instead of passing Mfocus_out to
        m17n-lib. */
-    minput_reset_ic (m17n->context);
+    if (!m17n->ic_clean)
+        ibus_m17n_engine_reset_ic (m17n);
+    ibus_m17n_engine_flush_updates (m17n);
+    m17n->preedit_valid = FALSE;
 
+    /* IBusEngineSimple drops its sequence */
+    m17n->compose_active = FALSE;
     IBUS_ENGINE_CLASS (parent_class)->focus_out (engine);
 }
 
@@ -926,9 +2439,17 @@ ibus_m17n_engine_reset (IBusEngine *engine)
 {
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
+    /* As in focus_out, the commit goes out before the queued keys. */
+    ibus_m17n_engine_flush_commit (m17n);
+    ibus_m17n_engine_release_pending_keys (m17n, TRUE);
+
     IBUS_ENGINE_CLASS (parent_class)->reset (engine);
+    m17n->compose_active = FALSE;
 
-    minput_reset_ic (m17n->context);
+    if (!m17n->ic_clean)
+        ibus_m17n_engine_reset_ic (m17n);
+    ibus_m17n_engine_flush_updates (m17n);
+    m17n->preedit_valid = FALSE;
 }
 
 static void
@@ -936,6 +2457,8 @@ ibus_m17n_engine_enable (IBusEngine *engine)
 {
     IBUS_ENGINE_CLASS (parent_class)->enable (engine);
 
+    ibus_m17n_engine_mru_add (ibus_engine_get_name (engine));
+
     /* Issue a dummy ibus_engine_get_surrounding_text() call to tell
        input context that we will use surrounding-text. */
     ibus_engine_get_surrounding_text (engine, NULL, NULL, NULL);
@@ -953,7 +2476,8 @@ ibus_m17n_engine_page_up (IBusEngine *engine)
 {
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
-    ibus_m17n_engine_process_key (m17n, msymbol ("Up"));
+    ibus_m17n_engine_process_key (m17n, Mkey_up);
+    ibus_m17n_engine_flush_updates (m17n);
     IBUS_ENGINE_CLASS (parent_class)->page_up (engine);
 }
 
@@ -963,7 +2487,8 @@ ibus_m17n_engine_page_down (IBusEngine *engine)
 
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
-    ibus_m17n_engine_process_key (m17n, msymbol ("Down"));
+    ibus_m17n_engine_process_key (m17n, Mkey_down);
+    ibus_m17n_engine_flush_updates (m17n);
     IBUS_ENGINE_CLASS (parent_class)->page_down (engine);
 }
 
@@ -973,7 +2498,8 @@ ibus_m17n_engine_cursor_up (IBusEngine *engine)
 
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
-    ibus_m17n_engine_process_key (m17n, msymbol ("Left"));
+    ibus_m17n_engine_process_key (m17n, Mkey_left);
+    ibus_m17n_engine_flush_updates (m17n);
     IBUS_ENGINE_CLASS (parent_class)->cursor_up (engine);
 }
 
@@ -983,7 +2509,8 @@ ibus_m17n_engine_cursor_down (IBusEngine *engine)
 
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
-    ibus_m17n_engine_process_key (m17n, msymbol ("Right"));
+    ibus_m17n_engine_process_key (m17n, Mkey_right);
+    ibus_m17n_engine_flush_updates (m17n);
     IBUS_ENGINE_CLASS (parent_class)->cursor_down (engine);
 }
 
@@ -1017,10 +2544,16 @@ ibus_m17n_engine_set_content_type (IBusEngine      *engine,
                                    IBusInputHints   hints)
 {
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
+    gboolean purpose_changed = m17n->purpose != purpose;
 
     m17n->purpose = purpose;
     m17n->hints = hints;
 
+    /* Only the purpose matters, clients send the content type on
+       every focus change. */
+    if (!purpose_changed)
+        return;
+
     switch (purpose) {
     case IBUS_INPUT_PURPOSE_PASSWORD:
     case IBUS_INPUT_PURPOSE_PIN:
@@ -1036,91 +2569,371 @@ ibus_m17n_engine_set_content_type (IBusEngine      *engine,
     }
 }
 
+/* Key name recorded in traces, never for password and PIN input */
+static const gchar *
+ibus_m17n_engine_trace_key (IBusM17NEngine *m17n,
+                            MSymbol         key)
+{
+    switch (m17n->purpose) {
+    case IBUS_INPUT_PURPOSE_PASSWORD:
+    case IBUS_INPUT_PURPOSE_PIN:
+        return NULL;
+
+    default:
+        break;
+    }
+
+    return key != Mnil ? msymbol_name (key) : NULL;
+}
+
 static void
-ibus_m17n_engine_update_lookup_table (IBusM17NEngine *m17n)
+ibus_m17n_engine_set_surrounding_text (IBusEngine *engine,
+                                       IBusText   *text,
+                                       guint       cursor_pos,
+                                       guint       anchor_pos)
+{
+    IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
+
+    IBUS_ENGINE_CLASS (parent_class)->set_surrounding_text (engine,
+                                                            text,
+                                                            cursor_pos,
+                                                            anchor_pos);
+    ibus_m17n_engine_clear_surrounding (m17n);
+}
+
+static void
+ibus_m17n_engine_clear_surrounding (IBusM17NEngine *m17n)
+{
+    if (m17n->surrounding_text) {
+        g_object_unref (m17n->surrounding_text);
+        m17n->surrounding_text = NULL;
+    }
+    if (m17n->surrounding) {
+        m17n_object_unref (m17n->surrounding);
+        m17n->surrounding = NULL;
+    }
+}
+
+/* Return the surrounding text LEN characters before (LEN < 0) or
+   after (LEN > 0) the cursor.  The text is fetched from the client
+   once per update and only the requested window is decoded. */
+static MText *
+ibus_m17n_engine_get_surrounding (IBusM17NEngine *m17n,
+                                  gint            len)
+{
+    const gchar *start, *end;
+    gint n;
+
+    if (m17n->surrounding && m17n->surrounding_len == len)
+        return m17n->surrounding;
+
+    if (m17n->surrounding_text == NULL) {
+        guint cursor_pos, anchor_pos;
+
+        ibus_engine_get_surrounding_text ((IBusEngine *) m17n,
+                                          &m17n->surrounding_text,
+                                          &cursor_pos,
+                                          &anchor_pos);
+        start = m17n->surrounding_text->text;
+        for (end = start; cursor_pos > 0 && *end; cursor_pos--)
+            end = g_utf8_next_char (end);
+        m17n->surrounding_cursor = end - start;
+    }
+
+    if (m17n->surrounding) {
+        m17n_object_unref (m17n->surrounding);
+        m17n->surrounding = NULL;
+    }
+
+    start = end = m17n->surrounding_text->text + m17n->surrounding_cursor;
+    if (len < 0) {
+        for (n = -len; n > 0 && start > m17n->surrounding_text->text; n--)
+            start = g_utf8_prev_char (start);
+    }
+    else {
+        for (n = len; n > 0 && *end; n--)
+            end = g_utf8_next_char (end);
+    }
+
+    if (start != end)
+        m17n->surrounding = mconv_decode_buffer (Mcoding_utf_8,
+                                                 (const unsigned char *) start,
+                                                 end - start);
+    if (m17n->surrounding == NULL)
+        m17n->surrounding = mtext ();
+    m17n->surrounding_len = len;
+
+    return m17n->surrounding;
+}
+
+static void
+ibus_m17n_engine_hide_lookup_table (IBusM17NEngine *m17n)
+{
+    if (m17n->lookup_table_visible) {
+        ibus_engine_hide_lookup_table ((IBusEngine *) m17n);
+        m17n->lookup_table_visible = FALSE;
+    }
+    if (m17n->candidate_page != 0) {
+        ibus_engine_hide_auxiliary_text ((IBusEngine *) m17n);
+        m17n->candidate_page = 0;
+    }
+}
+
+/* Forget the candidate group shown in the lookup table. */
+static void
+ibus_m17n_engine_clear_candidates (IBusM17NEngine *m17n)
+{
+    if (m17n->candidate_list) {
+        m17n_object_unref (m17n->candidate_list);
+        m17n->candidate_list = NULL;
+    }
+    m17n->candidate_group = NULL;
+    m17n->candidate_offset = 0;
+    m17n->candidate_group_page = 0;
+    m17n->candidate_npages = 0;
+}
+
+static void
+ibus_m17n_engine_fill_lookup_table (IBusM17NEngine *m17n,
+                                    MPlist         *group)
 {
     ibus_lookup_table_clear (m17n->table);
 
-    if (m17n->context->candidate_list && m17n->context->candidate_show) {
-        IBusText *text;
-        MPlist *group;
-        group = m17n->context->candidate_list;
-        gint i = 0;
-        gint page = 1;
-        IBusM17NEngineClass *klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
-
-        while (1) {
-            gint len;
-            if (mplist_key (group) == Mtext)
-                len = mtext_len ((MText *) mplist_value (group));
-            else
-                len = mplist_length ((MPlist *) mplist_value (group));
+    if (mplist_key (group) == Mtext) {
+        MText *mt;
+        gunichar *buf;
+        glong nchars, i;
 
-            if (i + len > m17n->context->candidate_index)
-                break;
+        mt = (MText *) mplist_value (group);
+        ibus_lookup_table_set_page_size (m17n->table, mtext_len (mt));
 
-            i += len;
-            group = mplist_next (group);
-            page ++;
-        }
+        buf = ibus_m17n_mtext_to_ucs4 (mt, &nchars);
+        g_warn_if_fail (buf != NULL);
 
-        if (mplist_key (group) == Mtext) {
-            MText *mt;
-            gunichar *buf;
-            glong nchars, i;
+        for (i = 0; buf != NULL && i < nchars; i++) {
+            IBusText *text = ibus_text_new_from_unichar (buf[i]);
+            if (text == NULL) {
+                text = ibus_text_new_from_printf ("INVCODE=U+%04"G_GINT32_FORMAT"X", buf[i]);
+                g_warn_if_reached ();
+            }
+            ibus_lookup_table_append_candidate (m17n->table, text);
+        }
+        g_free (buf);
+    }
+    else {
+        MPlist *p;
 
-            mt = (MText *) mplist_value (group);
-            ibus_lookup_table_set_page_size (m17n->table, mtext_len (mt));
+        p = (MPlist *) mplist_value (group);
+        ibus_lookup_table_set_page_size (m17n->table, mplist_length (p));
 
-            buf = ibus_m17n_mtext_to_ucs4 (mt, &nchars);
-            g_warn_if_fail (buf != NULL);
+        for (; mplist_key (p) != Mnil; p = mplist_next (p)) {
+            MText *mtext;
+            IBusText *text;
 
-            for (i = 0; buf != NULL && i < nchars; i++) {
-                IBusText *text = ibus_text_new_from_unichar (buf[i]);
-                if (text == NULL) {
-                    text = ibus_text_new_from_printf ("INVCODE=U+%04"G_GINT32_FORMAT"X", buf[i]);
-                    g_warn_if_reached ();
-                }
+            mtext = (MText *) mplist_value (p);
+            text = ibus_m17n_text_new_from_mtext (mtext);
+            if (text) {
                 ibus_lookup_table_append_candidate (m17n->table, text);
             }
-            g_free (buf);
-        }
-        else {
-            MPlist *p;
-
-            p = (MPlist *) mplist_value (group);
-            ibus_lookup_table_set_page_size (m17n->table, mplist_length (p));
-
-            for (; mplist_key (p) != Mnil; p = mplist_next (p)) {
-                MText *mtext;
-                gchar *buf;
-
-                mtext = (MText *) mplist_value (p);
-                buf = ibus_m17n_mtext_to_utf8 (mtext);
-                if (buf) {
-                    ibus_lookup_table_append_candidate (m17n->table,
-                        ibus_text_new_from_string (buf));
-                    g_free (buf);
-                }
-                else {
-                    ibus_lookup_table_append_candidate (m17n->table,
-                        ibus_text_new_from_static_string ("NULL"));
-                    g_warn_if_reached();
-                }
+            else {
+                ibus_lookup_table_append_candidate (m17n->table,
+                    ibus_text_new_from_static_string ("NULL"));
+                g_warn_if_reached();
             }
         }
+    }
+}
 
-        ibus_lookup_table_set_cursor_pos (m17n->table, m17n->context->candidate_index - i);
-        ibus_lookup_table_set_orientation (m17n->table, klass->lookup_table_orientation);
+/* Show the candidate group of the current candidate.  The group, its
+   offset and the page count are cached, so moving the cursor within
+   a group only sends the table again with the new cursor position,
+   and the auxiliary text is only sent when the page changes. */
+static void
+ibus_m17n_engine_update_lookup_table (IBusM17NEngine *m17n)
+{
+    MInputContext *context = m17n->context;
+    IBusM17NEngineClass *klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+    MPlist *group;
+    gint i, page, cursor_pos;
+    gboolean table_changed = FALSE;
+
+    if (!context->candidate_list || !context->candidate_show) {
+        ibus_m17n_engine_hide_lookup_table (m17n);
+        if (!context->candidate_list)
+            ibus_m17n_engine_clear_candidates (m17n);
+        return;
+    }
 
-        text = ibus_text_new_from_printf ("( %d / %d )", page, mplist_length (m17n->context->candidate_list));
+    if (context->candidate_list != m17n->candidate_list) {
+        ibus_m17n_engine_clear_candidates (m17n);
+        /* Hold a reference, so the address cannot be reused by another
+           candidate list while it is cached. */
+        m17n->candidate_list = m17n_object_ref (context->candidate_list);
+        m17n->candidate_npages = mplist_length (context->candidate_list);
+    }
 
+    if (m17n->candidate_group != NULL &&
+        context->candidate_index >= m17n->candidate_offset) {
+        group = m17n->candidate_group;
+        i = m17n->candidate_offset;
+        page = m17n->candidate_group_page;
+    }
+    else {
+        group = context->candidate_list;
+        i = 0;
+        page = 1;
+    }
+
+    while (1) {
+        gint len;
+        if (mplist_key (group) == Mtext)
+            len = mtext_len ((MText *) mplist_value (group));
+        else
+            len = mplist_length ((MPlist *) mplist_value (group));
+
+        if (i + len > context->candidate_index)
+            break;
+
+        i += len;
+        group = mplist_next (group);
+        page ++;
+    }
+
+    if (group != m17n->candidate_group) {
+        ibus_m17n_engine_fill_lookup_table (m17n, group);
+        m17n->candidate_group = group;
+        m17n->candidate_offset = i;
+        m17n->candidate_group_page = page;
+        table_changed = TRUE;
+    }
+
+    cursor_pos = context->candidate_index - i;
+    if (table_changed ||
+        !m17n->lookup_table_visible ||
+        ibus_lookup_table_get_cursor_pos (m17n->table) != cursor_pos ||
+        ibus_lookup_table_get_orientation (m17n->table) != klass->lookup_table_orientation) {
+        ibus_lookup_table_set_cursor_pos (m17n->table, cursor_pos);
+        ibus_lookup_table_set_orientation (m17n->table, klass->lookup_table_orientation);
         ibus_engine_update_lookup_table ((IBusEngine *)m17n, m17n->table, TRUE);
+        m17n->lookup_table_visible = TRUE;
+    }
+
+    if (m17n->candidate_page != page) {
+        IBusText *text;
+
+        text = ibus_text_new_from_printf ("( %d / %d )", page, m17n->candidate_npages);
         ibus_engine_update_auxiliary_text ((IBusEngine *)m17n, text, TRUE);
+        m17n->candidate_page = page;
+    }
+}
+
+static void
+ibus_m17n_engine_update_status (IBusM17NEngine *m17n)
+{
+    GString *status = m17n->scratch;
+    IBusM17NEngineClass *klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+    gboolean visible;
+
+    g_string_truncate (status, 0);
+    ibus_m17n_mtext_append_utf8 (status, m17n->context->status);
+
+    visible = status->len && g_strcmp0 (status->str, klass->title);
+    if (!visible)
+        g_string_truncate (status, 0);
+
+    /* Many IMs redraw the status on every key, only tell the panel
+       when it really changes. */
+    if (m17n->status_valid &&
+        m17n->status_visible == visible &&
+        strcmp (m17n->status_text->str, status->str) == 0)
+        return;
+
+    g_string_assign (m17n->status_text, status->str);
+    m17n->status_visible = visible;
+    m17n->status_valid = TRUE;
+
+    if (visible) {
+        ibus_property_set_label (m17n->status_prop,
+                                 ibus_m17n_engine_class_get_status_label (klass,
+                                                                          status->str));
+        ibus_property_set_visible (m17n->status_prop, TRUE);
     }
     else {
-        ibus_engine_hide_lookup_table ((IBusEngine *)m17n);
-        ibus_engine_hide_auxiliary_text ((IBusEngine *)m17n);
+        ibus_property_set_label (m17n->status_prop, NULL);
+        ibus_property_set_visible (m17n->status_prop, FALSE);
+    }
+
+    ibus_engine_update_property ((IBusEngine *)m17n, m17n->status_prop);
+}
+
+/* Send the text committed during a burst */
+static void
+ibus_m17n_engine_flush_commit (IBusM17NEngine *m17n)
+{
+    IBusM17NEngineClass *klass =
+        (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+    gint64 start;
+
+    if (m17n->pending_commit == NULL || m17n->pending_commit->len == 0)
+        return;
+
+    start = ibus_m17n_trace_now ();
+    ibus_engine_commit_text ((IBusEngine *) m17n,
+                             ibus_text_new_from_string (m17n->pending_commit->str));
+    g_string_truncate (m17n->pending_commit, 0);
+    ibus_m17n_engine_clear_surrounding (m17n);
+    IBUS_M17N_TRACE (IBUS_M17N_TRACE_COMMIT, start, klass->engine_name, NULL);
+}
+
+static gboolean
+ibus_m17n_engine_flush_updates_cb (gpointer user_data)
+{
+    IBusM17NEngine *m17n = (IBusM17NEngine *) user_data;
+
+    m17n->flush_id = 0;
+    ibus_m17n_engine_flush_updates (m17n);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Send the changes recorded by ibus_m17n_engine_callback() since the
+   last flush, in a fixed order and at most once each. */
+static void
+ibus_m17n_engine_flush_updates (IBusM17NEngine *m17n)
+{
+    IBusM17NEngineClass *klass =
+        (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+    EngineUpdateMask updates = m17n->updates;
+    gint64 start;
+
+    if (m17n->flush_id != 0) {
+        g_source_remove (m17n->flush_id);
+        m17n->flush_id = 0;
+    }
+
+    ibus_m17n_engine_flush_commit (m17n);
+
+    if (updates == 0 || m17n->context == NULL)
+        return;
+    m17n->updates = 0;
+
+    if (updates & ENGINE_UPDATE_PREEDIT_MASK) {
+        start = ibus_m17n_trace_now ();
+        ibus_m17n_engine_update_preedit (m17n);
+        IBUS_M17N_TRACE (IBUS_M17N_TRACE_UPDATE_PREEDIT, start,
+                         klass->engine_name, NULL);
+    }
+    if (updates & ENGINE_UPDATE_LOOKUP_TABLE_MASK) {
+        start = ibus_m17n_trace_now ();
+        ibus_m17n_engine_update_lookup_table (m17n);
+        IBUS_M17N_TRACE (IBUS_M17N_TRACE_UPDATE_LOOKUP_TABLE, start,
+                         klass->engine_name, NULL);
+    }
+    if (updates & ENGINE_UPDATE_STATUS_MASK) {
+        start = ibus_m17n_trace_now ();
+        ibus_m17n_engine_update_status (m17n);
+        IBUS_M17N_TRACE (IBUS_M17N_TRACE_UPDATE_STATUS, start,
+                         klass->engine_name, NULL);
     }
 }
 
@@ -1129,6 +2942,7 @@ ibus_m17n_engine_callback (MInputContext *context,
                            MSymbol        command)
 {
     IBusM17NEngine *m17n = NULL;
+    gint64 start = ibus_m17n_trace_now ();
 
     m17n = context->arg;
     /* m17n always can be NULL when create_ic_for_im() calls minput_create_ic()
@@ -1144,49 +2958,24 @@ ibus_m17n_engine_callback (MInputContext *context,
         m17n->context = context;
     }
 
-    if (command == Minput_preedit_start) {
-        ibus_engine_hide_preedit_text ((IBusEngine *)m17n);
-    }
-    else if (command == Minput_preedit_draw) {
-        ibus_m17n_engine_update_preedit (m17n);
-    }
-    else if (command == Minput_preedit_done) {
-        ibus_engine_hide_preedit_text ((IBusEngine *)m17n);
+    /* Only remember what has changed, the changes are sent to the
+       client at once by ibus_m17n_engine_flush_updates(). */
+    if (command == Minput_preedit_start ||
+        command == Minput_preedit_draw ||
+        command == Minput_preedit_done) {
+        m17n->updates |= ENGINE_UPDATE_PREEDIT_MASK;
     }
     else if (command == Minput_status_start) {
-        ibus_engine_hide_preedit_text ((IBusEngine *)m17n);
     }
     else if (command == Minput_status_draw) {
-        gchar *status;
-        status = ibus_m17n_mtext_to_utf8 (m17n->context->status);
-        IBusM17NEngineClass *klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
-
-        if (status && strlen (status) && g_strcmp0 (status, klass->title)) {
-            IBusText *text;
-            text = ibus_text_new_from_string (status);
-            ibus_property_set_label (m17n->status_prop, text);
-            ibus_property_set_visible (m17n->status_prop, TRUE);
-        }
-        else {
-            ibus_property_set_label (m17n->status_prop, NULL);
-            ibus_property_set_visible (m17n->status_prop, FALSE);
-        }
-
-        ibus_engine_update_property ((IBusEngine *)m17n, m17n->status_prop);
-        g_free (status);
+        m17n->updates |= ENGINE_UPDATE_STATUS_MASK;
     }
     else if (command == Minput_status_done) {
     }
-    else if (command == Minput_candidates_start) {
-        ibus_engine_hide_lookup_table ((IBusEngine *) m17n);
-        ibus_engine_hide_auxiliary_text ((IBusEngine *) m17n);
-    }
-    else if (command == Minput_candidates_draw) {
-        ibus_m17n_engine_update_lookup_table (m17n);
-    }
-    else if (command == Minput_candidates_done) {
-        ibus_engine_hide_lookup_table ((IBusEngine *) m17n);
-        ibus_engine_hide_auxiliary_text ((IBusEngine *) m17n);
+    else if (command == Minput_candidates_start ||
+             command == Minput_candidates_draw ||
+             command == Minput_candidates_done) {
+        m17n->updates |= ENGINE_UPDATE_LOOKUP_TABLE_MASK;
     }
     else if (command == Minput_set_spot) {
     }
@@ -1197,47 +2986,23 @@ ibus_m17n_engine_callback (MInputContext *context,
     else if (command == Minput_get_surrounding_text &&
              (((IBusEngine *) m17n)->client_capabilities &
               IBUS_CAP_SURROUNDING_TEXT) != 0) {
-        IBusText *text;
-        guint cursor_pos, anchor_pos, nchars, nbytes;
-        MText *mt, *surround;
-        int len, pos;
-
-        ibus_engine_get_surrounding_text ((IBusEngine *) m17n,
-                                          &text,
-                                          &cursor_pos,
-                                          &anchor_pos);
-        nchars = ibus_text_get_length (text);
-        nbytes = g_utf8_offset_to_pointer (text->text, nchars) - text->text;
-        mt = mconv_decode_buffer (Mcoding_utf_8,
-                                  (const unsigned char *) text->text,
-                                  nbytes);
-        g_object_unref (text);
+        MText *surround;
 
-        len = (long) mplist_value (m17n->context->plist);
-        if (len < 0) {
-            pos = cursor_pos + len;
-            if (pos < 0)
-                pos = 0;
-            surround = mtext_duplicate (mt, pos, cursor_pos);
-        }
-        else if (len > 0) {
-            pos = cursor_pos + len;
-            if (pos > nchars)
-                pos = nchars;
-            surround = mtext_duplicate (mt, cursor_pos, pos);
-        }
-        else {
-            surround = mtext ();
-        }
-        m17n_object_unref (mt);
+        ((IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n))->uses_surrounding = TRUE;
+        /* The text must include what was just committed */
+        ibus_m17n_engine_flush_commit (m17n);
+        surround = ibus_m17n_engine_get_surrounding (m17n,
+            (long) mplist_value (m17n->context->plist));
         mplist_set (m17n->context->plist, Mtext, surround);
-        m17n_object_unref (surround);
     }
     else if (command == Minput_delete_surrounding_text &&
              (((IBusEngine *) m17n)->client_capabilities &
               IBUS_CAP_SURROUNDING_TEXT) != 0) {
         int len;
 
+        /* The text to delete may not have been committed yet */
+        ibus_m17n_engine_flush_commit (m17n);
+
         len = (long) mplist_value (m17n->context->plist);
         if (len < 0)
             ibus_engine_delete_surrounding_text ((IBusEngine *) m17n,
@@ -1245,5 +3010,10 @@ ibus_m17n_engine_callback (MInputContext *context,
         else if (len > 0)
             ibus_engine_delete_surrounding_text ((IBusEngine *) m17n,
                                                  0, len);
+        ibus_m17n_engine_clear_surrounding (m17n);
     }
+
+    IBUS_M17N_TRACE (IBUS_M17N_TRACE_CALLBACK, start,
+                     ((IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n))->engine_name,
+                     msymbol_name (command));
 }
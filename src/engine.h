@@ -6,4 +6,22 @@
 
 GType   ibus_m17n_engine_get_type_for_name (const gchar *name);
 
+/* Open the recently used input methods while the main loop is idle */
+void    ibus_m17n_engine_prewarm           (void);
+
+/* Default idle timeout of ibus_m17n_engine_set_im_limits() */
+#define IBUS_M17N_IM_IDLE_TIMEOUT 600
+
+/* Close input methods which have had no input contexts for
+   IDLE_TIMEOUT seconds, and idle ones beyond MEMORY_BUDGET bytes.
+   The recently used ones ibus_m17n_engine_prewarm() opens are only
+   closed beyond the budget.  0 disables either limit.  The memory of
+   an input method is an estimate, so the budget is only approximately
+   kept. */
+void    ibus_m17n_engine_set_im_limits     (guint        idle_timeout,
+                                            gsize        memory_budget);
+
+/* Log the resident input methods and their approximate heap usage */
+void    ibus_m17n_engine_print_im_stats    (void);
+
 #endif
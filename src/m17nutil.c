@@ -5,20 +5,74 @@
 
 #include <string.h>
 #include <errno.h>
+#include <glib/gstdio.h>
 #include "m17nutil.h"
+#include "mimscan.h"
 
 #define N_(text) text
 
 static MConverter *utf8_converter = NULL;
+/* see ibus_m17n_text_new_from_mtext() */
+static GString *utf8_buffer = NULL;
 
-#define DEFAULT_XML (PKGDATADIR "/default.xml")
+/* Binary form of default.xml written by ibus_m17n_config_compile().
+   All integers are little endian and strings are offsets into a table
+   of NUL terminated strings, so the file can be used where it is
+   mapped. */
+#define CONFIG_BINARY_MAGIC "IM17NCFG"
+#define CONFIG_BINARY_VERSION 4
+#define CONFIG_BINARY_NO_STRING ((guint32) -1)
+
+struct _ConfigBinaryHeader {
+    gchar magic[8];
+    guint32 version;
+    guint32 n_rules;
+    guint32 strings_offset;
+    guint32 strings_size;
+    /* ConfigBinarySource after the rules */
+    guint32 n_sources;
+    guint32 sources_offset;
+};
+typedef struct _ConfigBinaryHeader ConfigBinaryHeader;
+
+struct _ConfigBinaryRule {
+    guint32 name;
+    guint32 mask;
+    gint32 rank;
+    guint32 symbol;
+    guint32 longname;
+    guint32 layout;
+    guint32 preedit_highlight;
+    guint32 reference_layout;
+};
+typedef struct _ConfigBinaryRule ConfigBinaryRule;
+
+/* XML file the rules were compiled from, in order, see
+   ibus_m17n_engine_config_get_sources() */
+struct _ConfigBinarySource {
+    /* name relative to the package data directory */
+    guint32 path;
+    /* SHA-256 of the contents */
+    guint32 checksum;
+};
+typedef struct _ConfigBinarySource ConfigBinarySource;
+
+/* Directory in the package data directory with site specific rules,
+   applied after default.xml in the order of their names */
+#define CONFIG_OVERRIDES_DIR "overrides"
+
+/* Bump when the engine descriptions written to the cache change */
+#define ENGINES_CACHE_VERSION 1
+/* (version, package version, languages, stamps, engines) */
+#define ENGINES_CACHE_TYPE "(ussa(sxt)av)"
 
 typedef enum {
     ENGINE_CONFIG_RANK_MASK = 1 << 0,
     ENGINE_CONFIG_SYMBOL_MASK = 1 << 1,
     ENGINE_CONFIG_LONGNAME_MASK = 1 << 2,
     ENGINE_CONFIG_LAYOUT_MASK = 1 << 3,
-    ENGINE_CONFIG_PREEDIT_HIGHLIGHT_MASK = 1 << 4
+    ENGINE_CONFIG_PREEDIT_HIGHLIGHT_MASK = 1 << 4,
+    ENGINE_CONFIG_REFERENCE_LAYOUT_MASK = 1 << 5
 } EngineConfigMask;
 
 struct _EngineConfigNode {
@@ -28,7 +82,39 @@ struct _EngineConfigNode {
 };
 typedef struct _EngineConfigNode EngineConfigNode;
 
-static GSList *config_list = NULL;
+/* rules in the order of default.xml */
+static GPtrArray *config_rules = NULL;
+/* default.bin while the rules point into it */
+static GMappedFile *config_mapped = NULL;
+
+/* Node of the trie of rules whose name ends with the only wildcard,
+   like "m17n:hi:*" */
+struct _EngineConfigTrie {
+    struct _EngineConfigTrie *children;
+    struct _EngineConfigTrie *next;
+    gchar c;
+    /* indices into config_rules of the rules ending here */
+    GArray *rules;
+};
+typedef struct _EngineConfigTrie EngineConfigTrie;
+
+/* Rule whose name needs full pattern matching */
+struct _EngineConfigGlob {
+    GPatternSpec *pattern;
+    guint index;
+};
+typedef struct _EngineConfigGlob EngineConfigGlob;
+
+/* Index of config_rules, built by ibus_m17n_engine_config_index_build() */
+static GHashTable *config_exact = NULL;
+static EngineConfigTrie *config_prefix = NULL;
+static GSList *config_globs = NULL;
+/* resolved configurations by engine name */
+static GHashTable *config_memo = NULL;
+
+static void ibus_m17n_engine_config_load (void);
+static gint ibus_m17n_compare_strings    (gconstpointer a,
+                                          gconstpointer b);
 
 void
 ibus_m17n_init_common (void)
@@ -40,15 +126,50 @@ ibus_m17n_init_common (void)
     }
 }
 
+/* Return the data of TEXT in *DATA if TEXT is already stored as valid
+   UTF-8, so that it can be used without going through the
+   converter. */
+static gboolean
+ibus_m17n_mtext_get_utf8_data (MText        *text,
+                               const gchar **data,
+                               gint         *nbytes)
+{
+#ifdef HAVE_MTEXT_DATA
+    enum MTextFormat format;
+    int nunits;
+    const gchar *p;
+
+    p = (const gchar *) mtext_data (text, &format, &nunits, NULL, NULL);
+    if (format != MTEXT_FORMAT_US_ASCII && format != MTEXT_FORMAT_UTF_8)
+        return FALSE;
+    if (nunits > 0 && p == NULL)
+        return FALSE;
+    /* m17n-lib may store characters beyond U+10FFFF. */
+    if (format == MTEXT_FORMAT_UTF_8 && !g_utf8_validate (p, nunits, NULL))
+        return FALSE;
+
+    *data = nunits > 0 ? p : "";
+    *nbytes = nunits;
+    return TRUE;
+#else
+    return FALSE;
+#endif  /* !HAVE_MTEXT_DATA */
+}
+
 gchar *
 ibus_m17n_mtext_to_utf8 (MText *text)
 {
+    const gchar *data;
+    gint nbytes;
     gint bufsize;
     gchar *buf;
 
     if (text == NULL)
         return NULL;
 
+    if (ibus_m17n_mtext_get_utf8_data (text, &data, &nbytes))
+        return g_strndup (data, nbytes);
+
     mconv_reset_converter (utf8_converter);
 
     bufsize = (mtext_len (text) + 1) * 6;
@@ -61,33 +182,80 @@ ibus_m17n_mtext_to_utf8 (MText *text)
 
     buf [utf8_converter->nbytes] = 0;
 
-    return buf;
+    return g_realloc (buf, utf8_converter->nbytes + 1);
 }
 
-gunichar *
-ibus_m17n_mtext_to_ucs4 (MText *text, glong *nchars)
+void
+ibus_m17n_mtext_append_utf8 (GString *string,
+                             MText   *text)
 {
-    glong bufsize;
-    gchar *buf;
-    gunichar *ucs;
+    const gchar *data;
+    gint nbytes;
+    gsize len;
+    gint bufsize;
 
     if (text == NULL)
-        return NULL;
+        return;
 
-    mconv_reset_converter (utf8_converter);
+    if (ibus_m17n_mtext_get_utf8_data (text, &data, &nbytes)) {
+        g_string_append_len (string, data, nbytes);
+        return;
+    }
 
+    /* Encode directly into the spare room of STRING. */
+    len = string->len;
     bufsize = (mtext_len (text) + 1) * 6;
-    buf = (gchar *) g_malloc (bufsize);
+    g_string_set_size (string, len + bufsize);
 
+    mconv_reset_converter (utf8_converter);
     mconv_rebind_buffer (utf8_converter,
-                         (const unsigned char *) buf,
+                         (const unsigned char *) string->str + len,
                          bufsize);
-    if (mconv_encode (utf8_converter, text) < 0) {
-        g_free (buf);
+    if (mconv_encode (utf8_converter, text) < 0)
+        g_string_set_size (string, len);
+    else
+        g_string_set_size (string, len + utf8_converter->nbytes);
+}
+
+IBusText *
+ibus_m17n_text_new_from_mtext (MText *text)
+{
+    if (text == NULL)
         return NULL;
+
+    /* Encode into a reused buffer, so that the copy made by
+       ibus_text_new_from_string() is the only allocation. */
+    if (utf8_buffer == NULL)
+        utf8_buffer = g_string_sized_new (64);
+    g_string_truncate (utf8_buffer, 0);
+    ibus_m17n_mtext_append_utf8 (utf8_buffer, text);
+
+    return ibus_text_new_from_string (utf8_buffer->str);
+}
+
+gunichar *
+ibus_m17n_mtext_to_ucs4 (MText *text, glong *nchars)
+{
+    gunichar *ucs;
+    glong len, i;
+
+    if (text == NULL)
+        return NULL;
+
+    len = mtext_len (text);
+    ucs = g_new (gunichar, len + 1);
+    for (i = 0; i < len; i++) {
+        gint c = mtext_ref_char (text, i);
+        if (c < 0) {
+            g_free (ucs);
+            return NULL;
+        }
+        ucs[i] = c;
     }
-    ucs = g_utf8_to_ucs4_fast (buf, bufsize, nchars);
-    g_free (buf);
+    ucs[len] = 0;
+
+    if (nchars)
+        *nchars = len;
     return ucs;
 }
 
@@ -108,27 +276,21 @@ ibus_m17n_parse_color (const gchar *hex)
 }
 
 static IBusEngineDesc *
-ibus_m17n_engine_new (MSymbol  lang,
-                      MSymbol  name,
-                      MText   *title,
-                      MText   *icon,
-                      MText   *desc,
+ibus_m17n_engine_new (MSymbol      lang,
+                      MSymbol      name,
+                      const gchar *engine_title,
+                      const gchar *engine_icon,
+                      const gchar *engine_desc,
                       IBusM17NEngineConfig *config)
 {
     IBusEngineDesc *engine;
     gchar *engine_name;
     gchar *engine_longname;
-    gchar *engine_title;
-    gchar *engine_icon;
-    gchar *engine_desc;
     gchar *engine_setup;
 
     engine_name = g_strdup_printf ("m17n:%s:%s", msymbol_name (lang), msymbol_name (name));
 
     engine_longname = g_strdup_printf ("%s-%s (m17n)", msymbol_name (lang), msymbol_name (name));
-    engine_title = ibus_m17n_mtext_to_utf8 (title);
-    engine_icon = ibus_m17n_mtext_to_utf8 (icon);
-    engine_desc = ibus_m17n_mtext_to_utf8 (desc);
     engine_setup = g_strdup_printf ("%s/ibus-setup-m17n --name %s",
                                     LIBEXECDIR, engine_name);
 
@@ -146,9 +308,6 @@ ibus_m17n_engine_new (MSymbol  lang,
 
     g_free (engine_name);
     g_free (engine_longname);
-    g_free (engine_title);
-    g_free (engine_icon);
-    g_free (engine_desc);
     g_free (engine_setup);
 
     return engine;
@@ -162,9 +321,14 @@ GList *
 ibus_m17n_list_engines (void)
 {
     GList *engines = NULL;
+    GHashTable *headers;
     MPlist *imlist;
     MPlist *elm;
 
+    /* Reading the headers is much cheaper than asking m17n-lib, which
+       loads the whole input method. */
+    headers = ibus_m17n_mim_scan_db_dirs ();
+
     imlist = minput_list (Mnil);
     for (elm = imlist; elm && mplist_key(elm) != Mnil; elm = mplist_next(elm)) {
         MSymbol lang;
@@ -175,7 +339,11 @@ ibus_m17n_list_engines (void)
         MText *desc = NULL;
         MPlist *l;
         gchar *engine_name;
+        gchar *engine_title;
+        gchar *engine_icon;
+        gchar *engine_desc;
         IBusM17NEngineConfig *config;
+        IBusM17NMimHeader *header;
 
         l = mplist_value (elm);
         lang = mplist_value (l);
@@ -201,7 +369,25 @@ ibus_m17n_list_engines (void)
                 g_free (engine_name);
                 continue;
             }
+
+            header = g_hash_table_lookup (headers, engine_name + strlen ("m17n:"));
             g_free (engine_name);
+            if (header != NULL) {
+                /* The check below skips every input method declaring
+                   candidates-charset whatever its value, since its
+                   condition is always true.  Keep that rather than
+                   reading the value, so that the engine list does not
+                   depend on whether the header could be scanned. */
+                if (header->has_candidates_charset)
+                    continue;
+                engines = g_list_append (engines,
+                                         ibus_m17n_engine_new (lang, name,
+                                                               header->title,
+                                                               header->icon,
+                                                               header->description,
+                                                               config));
+                continue;
+            }
 
             l = minput_get_variable (lang, name, msymbol ("candidates-charset"));
             if (l) {
@@ -216,6 +402,9 @@ ibus_m17n_list_engines (void)
                 sl = mplist_next (sl);
                 varcharset = mplist_value (sl);
 
+                /* Always true, see above.  Such input methods
+                   offer candidates in legacy charsets and have
+                   never been listed. */
                 if (varcharset != Mcoding_utf_8 ||
                     varcharset != Mcoding_utf_8_full) {
                     /*
@@ -242,7 +431,18 @@ ibus_m17n_list_engines (void)
                 icon = mplist_value (n);
             }
 
-            engines = g_list_append (engines, ibus_m17n_engine_new (lang, name, title, icon, desc, config));
+            engine_title = ibus_m17n_mtext_to_utf8 (title);
+            engine_icon = ibus_m17n_mtext_to_utf8 (icon);
+            engine_desc = ibus_m17n_mtext_to_utf8 (desc);
+            engines = g_list_append (engines,
+                                     ibus_m17n_engine_new (lang, name,
+                                                           engine_title,
+                                                           engine_icon,
+                                                           engine_desc,
+                                                           config));
+            g_free (engine_title);
+            g_free (engine_icon);
+            g_free (engine_desc);
 
             if (desc)
                 m17n_object_unref (desc);
@@ -253,35 +453,209 @@ ibus_m17n_list_engines (void)
     if (imlist) {
         m17n_object_unref (imlist);
     }
+    g_hash_table_destroy (headers);
 
     return engines;
 }
 
-IBusM17NEngineConfig *
-ibus_m17n_get_engine_config (const gchar *engine_name)
+static void
+ibus_m17n_engine_config_trie_free (EngineConfigTrie *node)
+{
+    while (node != NULL) {
+        EngineConfigTrie *next = node->next;
+
+        ibus_m17n_engine_config_trie_free (node->children);
+        if (node->rules)
+            g_array_free (node->rules, TRUE);
+        g_slice_free (EngineConfigTrie, node);
+        node = next;
+    }
+}
+
+static void
+ibus_m17n_engine_config_trie_add (const gchar *prefix,
+                                  guint        index)
+{
+    EngineConfigTrie *node = config_prefix;
+    const gchar *p;
+
+    for (p = prefix; *p != '\0'; p++) {
+        EngineConfigTrie *child;
+
+        for (child = node->children; child != NULL; child = child->next) {
+            if (child->c == *p)
+                break;
+        }
+        if (child == NULL) {
+            child = g_slice_new0 (EngineConfigTrie);
+            child->c = *p;
+            child->next = node->children;
+            node->children = child;
+        }
+        node = child;
+    }
+
+    if (node->rules == NULL)
+        node->rules = g_array_new (FALSE, FALSE, sizeof (guint));
+    g_array_append_val (node->rules, index);
+}
+
+static void
+ibus_m17n_engine_config_glob_free (EngineConfigGlob *glob)
+{
+    g_pattern_spec_free (glob->pattern);
+    g_slice_free (EngineConfigGlob, glob);
+}
+
+/* Sort the rules by what their names need for matching: exact names
+   go to a hash table, names ending with the only "*" to a prefix trie
+   and everything else to a list of patterns. */
+static void
+ibus_m17n_engine_config_index_build (void)
+{
+    guint i;
+
+    if (config_exact != NULL) {
+        g_hash_table_destroy (config_exact);
+        ibus_m17n_engine_config_trie_free (config_prefix);
+        g_slist_free_full (config_globs,
+                           (GDestroyNotify) ibus_m17n_engine_config_glob_free);
+        g_hash_table_destroy (config_memo);
+    }
+
+    config_exact = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                          (GDestroyNotify) g_array_unref);
+    config_prefix = g_slice_new0 (EngineConfigTrie);
+    config_globs = NULL;
+    config_memo = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                         (GDestroyNotify) ibus_m17n_engine_config_free);
+
+    for (i = 0; i < config_rules->len; i++) {
+        EngineConfigNode *cnode = g_ptr_array_index (config_rules, i);
+        const gchar *wildcard;
+        gsize len;
+
+        if (cnode->name == NULL)
+            continue;
+
+        len = strlen (cnode->name);
+        wildcard = strpbrk (cnode->name, "*?");
+        if (wildcard == NULL) {
+            GArray *rules = g_hash_table_lookup (config_exact, cnode->name);
+
+            if (rules == NULL) {
+                rules = g_array_new (FALSE, FALSE, sizeof (guint));
+                g_hash_table_insert (config_exact, cnode->name, rules);
+            }
+            g_array_append_val (rules, i);
+        }
+        else if (wildcard == cnode->name + len - 1 && *wildcard == '*') {
+            gchar *prefix = g_strndup (cnode->name, len - 1);
+
+            ibus_m17n_engine_config_trie_add (prefix, i);
+            g_free (prefix);
+        }
+        else {
+            EngineConfigGlob *glob = g_slice_new (EngineConfigGlob);
+
+            glob->pattern = g_pattern_spec_new (cnode->name);
+            glob->index = i;
+            config_globs = g_slist_prepend (config_globs, glob);
+        }
+    }
+    config_globs = g_slist_reverse (config_globs);
+}
+
+static gint
+ibus_m17n_compare_rules (gconstpointer a,
+                         gconstpointer b)
+{
+    guint x = *(const guint *) a;
+    guint y = *(const guint *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static IBusM17NEngineConfig *
+ibus_m17n_engine_config_resolve (const gchar *engine_name)
 {
     IBusM17NEngineConfig *config = g_slice_new0 (IBusM17NEngineConfig);
+    EngineConfigTrie *node;
+    GArray *matches, *rules;
+    const gchar *c;
     GSList *p;
+    guint i;
+
+    matches = g_array_new (FALSE, FALSE, sizeof (guint));
+
+    rules = g_hash_table_lookup (config_exact, engine_name);
+    if (rules)
+        g_array_append_vals (matches, rules->data, rules->len);
 
-    for (p = config_list; p != NULL; p = p->next) {
-        EngineConfigNode *cnode = p->data;
-
-        if (g_pattern_match_simple (cnode->name, engine_name)) {
-            if (cnode->mask & ENGINE_CONFIG_RANK_MASK)
-                config->rank = cnode->config.rank;
-            if (cnode->mask & ENGINE_CONFIG_SYMBOL_MASK)
-                config->symbol = cnode->config.symbol;
-            if (cnode->mask & ENGINE_CONFIG_LONGNAME_MASK)
-                config->longname = cnode->config.longname;
-            if (cnode->mask & ENGINE_CONFIG_LAYOUT_MASK)
-                config->layout = cnode->config.layout;
-            if (cnode->mask & ENGINE_CONFIG_PREEDIT_HIGHLIGHT_MASK)
-                config->preedit_highlight = cnode->config.preedit_highlight;
+    for (node = config_prefix, c = engine_name; node != NULL; c++) {
+        if (node->rules)
+            g_array_append_vals (matches, node->rules->data, node->rules->len);
+        if (*c == '\0')
+            break;
+        for (node = node->children; node != NULL; node = node->next) {
+            if (node->c == *c)
+                break;
         }
     }
+
+    for (p = config_globs; p != NULL; p = p->next) {
+        EngineConfigGlob *glob = p->data;
+
+#if GLIB_CHECK_VERSION(2,70,0)
+        if (g_pattern_spec_match_string (glob->pattern, engine_name))
+#else
+        if (g_pattern_match_string (glob->pattern, engine_name))
+#endif
+            g_array_append_val (matches, glob->index);
+    }
+
+    /* Later rules override earlier ones. */
+    g_array_sort (matches, ibus_m17n_compare_rules);
+
+    for (i = 0; i < matches->len; i++) {
+        EngineConfigNode *cnode =
+            g_ptr_array_index (config_rules, g_array_index (matches, guint, i));
+
+        if (cnode->mask & ENGINE_CONFIG_RANK_MASK)
+            config->rank = cnode->config.rank;
+        if (cnode->mask & ENGINE_CONFIG_SYMBOL_MASK)
+            config->symbol = cnode->config.symbol;
+        if (cnode->mask & ENGINE_CONFIG_LONGNAME_MASK)
+            config->longname = cnode->config.longname;
+        if (cnode->mask & ENGINE_CONFIG_LAYOUT_MASK)
+            config->layout = cnode->config.layout;
+        if (cnode->mask & ENGINE_CONFIG_PREEDIT_HIGHLIGHT_MASK)
+            config->preedit_highlight = cnode->config.preedit_highlight;
+        if (cnode->mask & ENGINE_CONFIG_REFERENCE_LAYOUT_MASK)
+            config->reference_layout = cnode->config.reference_layout;
+    }
+    g_array_free (matches, TRUE);
+
     return config;
 }
 
+IBusM17NEngineConfig *
+ibus_m17n_get_engine_config (const gchar *engine_name)
+{
+    IBusM17NEngineConfig *config;
+
+    ibus_m17n_engine_config_load ();
+
+    config = g_hash_table_lookup (config_memo, engine_name);
+    if (config == NULL) {
+        config = ibus_m17n_engine_config_resolve (engine_name);
+        g_hash_table_insert (config_memo, g_strdup (engine_name), config);
+    }
+
+    /* The strings are owned by the rules. */
+    return g_slice_dup (IBusM17NEngineConfig, config);
+}
+
 void
 ibus_m17n_engine_config_free (IBusM17NEngineConfig *config)
 {
@@ -332,20 +706,681 @@ ibus_m17n_engine_config_parse_xml_node (EngineConfigNode *cnode,
             cnode->mask |= ENGINE_CONFIG_PREEDIT_HIGHLIGHT_MASK;
             continue;
         }
+        if (g_strcmp0 (sub_node->name , "reference-layout") == 0) {
+            g_free (cnode->config.reference_layout);
+            cnode->config.reference_layout = g_strdup (sub_node->text);
+            cnode->mask |= ENGINE_CONFIG_REFERENCE_LAYOUT_MASK;
+            continue;
+        }
         g_warning ("<engine> element contains invalid element <%s>",
                    sub_node->name);
     }
     return TRUE;
 }
 
+static gchar *
+ibus_m17n_get_pkgdata_filename (const gchar *basename)
+{
+    const gchar *pkgdatadir;
+
+    pkgdatadir = g_getenv ("IBUS_M17N_PKGDATADIR");
+    if (pkgdatadir == NULL)
+        pkgdatadir = PKGDATADIR;
+    return g_build_filename (pkgdatadir, basename, NULL);
+}
+
+/* Append the rules of the XML file FILENAME to RULES */
+static gboolean
+ibus_m17n_engine_config_parse_xml_file (const gchar *filename,
+                                        GPtrArray   *rules)
+{
+    XMLNode *node;
+    GList *p;
+
+    node = ibus_xml_parse_file (filename);
+    if (node == NULL || g_strcmp0 (node->name, "engines") != 0) {
+        g_warning ("failed to parse %s", filename);
+        if (node)
+            ibus_xml_free (node);
+        return FALSE;
+    }
+
+    for (p = node->sub_nodes; p != NULL; p = p->next) {
+        XMLNode *sub_node = p->data;
+        EngineConfigNode *cnode;
+
+        if (g_strcmp0 (sub_node->name, "engine") != 0) {
+            g_warning ("<engines> element contains invalid element <%s>",
+                       sub_node->name);
+            continue;
+        }
+
+        cnode = g_slice_new0 (EngineConfigNode);
+        if (!ibus_m17n_engine_config_parse_xml_node (cnode, sub_node)) {
+            g_slice_free (EngineConfigNode, cnode);
+            continue;
+        }
+        g_ptr_array_add (rules, cnode);
+    }
+    ibus_xml_free (node);
+
+    return TRUE;
+}
+
+static const gchar *
+ibus_m17n_config_binary_get_string (const gchar *strings,
+                                    guint32      strings_size,
+                                    guint32      offset,
+                                    gboolean    *ok)
+{
+    offset = GUINT32_FROM_LE (offset);
+    if (offset == CONFIG_BINARY_NO_STRING)
+        return NULL;
+    if (offset >= strings_size) {
+        *ok = FALSE;
+        return NULL;
+    }
+    return strings + offset;
+}
+
+/* Return the SHA-256 of the contents of FILENAME, or NULL */
+static gchar *
+ibus_m17n_config_file_checksum (const gchar *filename)
+{
+    gchar *contents, *checksum;
+    gsize length;
+
+    if (!g_file_get_contents (filename, &contents, &length, NULL))
+        return NULL;
+    checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+                                            (const guchar *) contents,
+                                            length);
+    g_free (contents);
+
+    return checksum;
+}
+
+/* Return the names relative to the package data directory of the XML
+   files the rules are read from, default.xml first. */
+static GPtrArray *
+ibus_m17n_engine_config_get_sources (void)
+{
+    GPtrArray *sources = g_ptr_array_new_with_free_func (g_free);
+    GPtrArray *overrides = g_ptr_array_new ();
+    gchar *dirname;
+    const gchar *name;
+    GDir *dir;
+    guint i;
+
+    g_ptr_array_add (sources, g_strdup ("default.xml"));
+
+    dirname = ibus_m17n_get_pkgdata_filename (CONFIG_OVERRIDES_DIR);
+    dir = g_dir_open (dirname, 0, NULL);
+    if (dir != NULL) {
+        while ((name = g_dir_read_name (dir)) != NULL) {
+            if (g_str_has_suffix (name, ".xml"))
+                g_ptr_array_add (overrides,
+                                 g_build_filename (CONFIG_OVERRIDES_DIR, name, NULL));
+        }
+        g_dir_close (dir);
+    }
+    g_free (dirname);
+
+    g_ptr_array_sort (overrides, ibus_m17n_compare_strings);
+    for (i = 0; i < overrides->len; i++)
+        g_ptr_array_add (sources, g_ptr_array_index (overrides, i));
+    g_ptr_array_free (overrides, TRUE);
+
+    return sources;
+}
+
+/* Use the rules in the binary file FILENAME if it was compiled from
+   exactly the XML files SOURCES with their current contents. */
+static gboolean
+ibus_m17n_engine_config_load_binary (const gchar *filename,
+                                     GPtrArray   *sources)
+{
+    GMappedFile *mapped;
+    const gchar *data, *strings;
+    const ConfigBinaryHeader *header;
+    const ConfigBinaryRule *rule;
+    const ConfigBinarySource *source;
+    EngineConfigNode *nodes;
+    guint32 n_rules, strings_offset, strings_size;
+    guint32 n_sources, sources_offset;
+    gsize length;
+    gboolean ok = TRUE, fresh = TRUE;
+    guint i;
+
+    mapped = g_mapped_file_new (filename, FALSE, NULL);
+    if (mapped == NULL)
+        return FALSE;
+    data = g_mapped_file_get_contents (mapped);
+    length = g_mapped_file_get_length (mapped);
+
+    header = (const ConfigBinaryHeader *) data;
+    if (length < sizeof (ConfigBinaryHeader) ||
+        memcmp (header->magic, CONFIG_BINARY_MAGIC, sizeof (header->magic)) != 0 ||
+        GUINT32_FROM_LE (header->version) != CONFIG_BINARY_VERSION) {
+        g_mapped_file_unref (mapped);
+        return FALSE;
+    }
+
+    n_rules = GUINT32_FROM_LE (header->n_rules);
+    strings_offset = GUINT32_FROM_LE (header->strings_offset);
+    strings_size = GUINT32_FROM_LE (header->strings_size);
+    if (n_rules > (length - sizeof (ConfigBinaryHeader)) / sizeof (ConfigBinaryRule) ||
+        strings_offset < sizeof (ConfigBinaryHeader) + n_rules * sizeof (ConfigBinaryRule) ||
+        strings_offset > length ||
+        strings_size > length - strings_offset ||
+        (strings_size > 0 && data[strings_offset + strings_size - 1] != '\0')) {
+        g_warning ("%s is corrupted", filename);
+        g_mapped_file_unref (mapped);
+        return FALSE;
+    }
+    strings = data + strings_offset;
+
+    n_sources = GUINT32_FROM_LE (header->n_sources);
+    sources_offset = GUINT32_FROM_LE (header->sources_offset);
+    if (sources_offset % 4 != 0 ||
+        sources_offset < sizeof (ConfigBinaryHeader) + n_rules * sizeof (ConfigBinaryRule) ||
+        sources_offset > strings_offset ||
+        n_sources > (strings_offset - sources_offset) / sizeof (ConfigBinarySource)) {
+        g_warning ("%s is corrupted", filename);
+        g_mapped_file_unref (mapped);
+        return FALSE;
+    }
+
+    /* Contents rather than mtimes, so that installing or building
+       the file again does not matter. */
+    if (n_sources != sources->len) {
+        g_debug ("%s was compiled from other files", filename);
+        fresh = FALSE;
+    }
+    source = (const ConfigBinarySource *) (data + sources_offset);
+    for (i = 0; i < n_sources && ok && fresh; i++, source++) {
+        const gchar *path, *checksum;
+        gchar *source_filename, *current;
+
+        path = ibus_m17n_config_binary_get_string (strings, strings_size,
+                                                   source->path, &ok);
+        checksum = ibus_m17n_config_binary_get_string (strings, strings_size,
+                                                       source->checksum, &ok);
+        if (path == NULL || checksum == NULL ||
+            strcmp (path, g_ptr_array_index (sources, i)) != 0) {
+            fresh = FALSE;
+            break;
+        }
+        source_filename = ibus_m17n_get_pkgdata_filename (path);
+        current = ibus_m17n_config_file_checksum (source_filename);
+        if (g_strcmp0 (current, checksum) != 0) {
+            g_debug ("%s changed since %s was compiled", source_filename, filename);
+            fresh = FALSE;
+        }
+        g_free (current);
+        g_free (source_filename);
+    }
+    if (!ok) {
+        g_warning ("%s is corrupted", filename);
+        fresh = FALSE;
+    }
+    if (!fresh) {
+        g_mapped_file_unref (mapped);
+        return FALSE;
+    }
+
+    /* The strings stay in the mapping, only the nodes are allocated. */
+    nodes = g_new0 (EngineConfigNode, n_rules);
+    rule = (const ConfigBinaryRule *) (data + sizeof (ConfigBinaryHeader));
+    for (i = 0; i < n_rules && ok; i++, rule++) {
+        EngineConfigNode *cnode = &nodes[i];
+
+        cnode->name = (gchar *)
+            ibus_m17n_config_binary_get_string (strings, strings_size,
+                                                rule->name, &ok);
+        cnode->mask = GUINT32_FROM_LE (rule->mask);
+        cnode->config.rank = GINT32_FROM_LE (rule->rank);
+        cnode->config.symbol = (gchar *)
+            ibus_m17n_config_binary_get_string (strings, strings_size,
+                                                rule->symbol, &ok);
+        cnode->config.longname = (gchar *)
+            ibus_m17n_config_binary_get_string (strings, strings_size,
+                                                rule->longname, &ok);
+        cnode->config.layout = (gchar *)
+            ibus_m17n_config_binary_get_string (strings, strings_size,
+                                                rule->layout, &ok);
+        cnode->config.preedit_highlight =
+            GUINT32_FROM_LE (rule->preedit_highlight);
+        cnode->config.reference_layout = (gchar *)
+            ibus_m17n_config_binary_get_string (strings, strings_size,
+                                                rule->reference_layout, &ok);
+    }
+    if (!ok) {
+        g_warning ("%s is corrupted", filename);
+        g_free (nodes);
+        g_mapped_file_unref (mapped);
+        return FALSE;
+    }
+
+    config_mapped = mapped;
+    config_rules = g_ptr_array_sized_new (n_rules);
+    for (i = 0; i < n_rules; i++)
+        g_ptr_array_add (config_rules, &nodes[i]);
+
+    return TRUE;
+}
+
+/* Load the rules once per process, from default.bin if it is up to
+   date and from default.xml and the override files otherwise. */
+static void
+ibus_m17n_engine_config_load (void)
+{
+    gchar *default_bin;
+    GPtrArray *sources;
+    guint i;
+
+    if (config_rules != NULL)
+        return;
+
+    default_bin = ibus_m17n_get_pkgdata_filename ("default.bin");
+    sources = ibus_m17n_engine_config_get_sources ();
+
+    if (!ibus_m17n_engine_config_load_binary (default_bin, sources)) {
+        config_rules = g_ptr_array_new ();
+        for (i = 0; i < sources->len; i++) {
+            gchar *filename =
+                ibus_m17n_get_pkgdata_filename (g_ptr_array_index (sources, i));
+
+            ibus_m17n_engine_config_parse_xml_file (filename, config_rules);
+            g_free (filename);
+        }
+    }
+    ibus_m17n_engine_config_index_build ();
+
+    g_ptr_array_free (sources, TRUE);
+    g_free (default_bin);
+}
+
+static guint32
+ibus_m17n_config_binary_add_string (GString     *strings,
+                                    GHashTable  *offsets,
+                                    const gchar *str)
+{
+    gpointer offset;
+
+    if (str == NULL)
+        return GUINT32_TO_LE (CONFIG_BINARY_NO_STRING);
+
+    if (!g_hash_table_lookup_extended (offsets, str, NULL, &offset)) {
+        offset = GUINT_TO_POINTER (strings->len);
+        g_hash_table_insert (offsets, (gpointer) str, offset);
+        g_string_append_len (strings, str, strlen (str) + 1);
+    }
+    return GUINT32_TO_LE (GPOINTER_TO_UINT (offset));
+}
+
+/* Sort the override files FILES after the first one by their
+   installed names PATHS, keeping both arrays parallel */
+static void
+ibus_m17n_config_sort_overrides (GPtrArray *files,
+                                 GPtrArray *paths)
+{
+    guint i, j;
+
+    /* Insertion sort, there are only a few. */
+    for (i = 2; i < paths->len; i++) {
+        for (j = i; j > 1 && strcmp (g_ptr_array_index (paths, j - 1),
+                                     g_ptr_array_index (paths, j)) > 0; j--) {
+            gpointer tmp;
+
+            tmp = paths->pdata[j];
+            paths->pdata[j] = paths->pdata[j - 1];
+            paths->pdata[j - 1] = tmp;
+            tmp = files->pdata[j];
+            files->pdata[j] = files->pdata[j - 1];
+            files->pdata[j - 1] = tmp;
+        }
+    }
+}
+
+gboolean
+ibus_m17n_config_compile (gchar      **xml_files,
+                          const gchar *filename,
+                          GError     **error)
+{
+    GPtrArray *rules;
+    GHashTable *offsets;
+    GString *output, *strings;
+    ConfigBinaryHeader header;
+    GPtrArray *files, *paths, *checksums;
+    gboolean ok = TRUE;
+    guint i;
+
+    /* The override files are installed into CONFIG_OVERRIDES_DIR and
+       applied in the order of their names, see
+       ibus_m17n_engine_config_get_sources(). */
+    files = g_ptr_array_new_with_free_func (g_free);
+    paths = g_ptr_array_new_with_free_func (g_free);
+    for (i = 0; xml_files[i] != NULL; i++) {
+        gchar *basename = g_path_get_basename (xml_files[i]);
+
+        g_ptr_array_add (files, g_strdup (xml_files[i]));
+        if (i == 0)
+            g_ptr_array_add (paths, g_strdup ("default.xml"));
+        else
+            g_ptr_array_add (paths, g_build_filename (CONFIG_OVERRIDES_DIR,
+                                                      basename, NULL));
+        g_free (basename);
+    }
+    ibus_m17n_config_sort_overrides (files, paths);
+
+    /* Rules of later files override the rules of earlier files. */
+    rules = g_ptr_array_new ();
+    for (i = 0; i < files->len; i++) {
+        if (!ibus_m17n_engine_config_parse_xml_file (g_ptr_array_index (files, i),
+                                                     rules)) {
+            g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                         "failed to parse %s",
+                         (const gchar *) g_ptr_array_index (files, i));
+            g_ptr_array_free (rules, TRUE);
+            g_ptr_array_free (files, TRUE);
+            g_ptr_array_free (paths, TRUE);
+            return FALSE;
+        }
+    }
+
+    strings = g_string_new (NULL);
+    offsets = g_hash_table_new (g_str_hash, g_str_equal);
+    output = g_string_new (NULL);
+
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, CONFIG_BINARY_MAGIC, sizeof (header.magic));
+    header.version = GUINT32_TO_LE (CONFIG_BINARY_VERSION);
+    header.n_rules = GUINT32_TO_LE (rules->len);
+    g_string_append_len (output, (const gchar *) &header, sizeof (header));
+
+    for (i = 0; i < rules->len; i++) {
+        EngineConfigNode *cnode = g_ptr_array_index (rules, i);
+        ConfigBinaryRule rule;
+
+        rule.name = ibus_m17n_config_binary_add_string (strings, offsets,
+                                                        cnode->name);
+        rule.mask = GUINT32_TO_LE (cnode->mask);
+        rule.rank = GINT32_TO_LE (cnode->config.rank);
+        rule.symbol = ibus_m17n_config_binary_add_string (strings, offsets,
+                                                          cnode->config.symbol);
+        rule.longname = ibus_m17n_config_binary_add_string (strings, offsets,
+                                                            cnode->config.longname);
+        rule.layout = ibus_m17n_config_binary_add_string (strings, offsets,
+                                                          cnode->config.layout);
+        rule.preedit_highlight =
+            GUINT32_TO_LE (cnode->config.preedit_highlight);
+        rule.reference_layout =
+            ibus_m17n_config_binary_add_string (strings, offsets,
+                                                cnode->config.reference_layout);
+        g_string_append_len (output, (const gchar *) &rule, sizeof (rule));
+    }
+
+    /* Stamp the sources by their installed names and contents, so
+       that the engine notices when they change. */
+    header.sources_offset = GUINT32_TO_LE (output->len);
+    header.n_sources = GUINT32_TO_LE (files->len);
+    checksums = g_ptr_array_new_with_free_func (g_free);
+    for (i = 0; i < files->len; i++) {
+        ConfigBinarySource source;
+        gchar *checksum;
+
+        checksum = ibus_m17n_config_file_checksum (g_ptr_array_index (files, i));
+        /* offsets keeps the pointers */
+        g_ptr_array_add (checksums, checksum);
+        source.path = ibus_m17n_config_binary_add_string (strings, offsets,
+                                                          g_ptr_array_index (paths, i));
+        source.checksum = ibus_m17n_config_binary_add_string (strings, offsets,
+                                                              checksum);
+        g_string_append_len (output, (const gchar *) &source, sizeof (source));
+    }
+
+    header.strings_offset = GUINT32_TO_LE (output->len);
+    header.strings_size = GUINT32_TO_LE (strings->len);
+    memcpy (output->str, &header, sizeof (header));
+    g_string_append_len (output, strings->str, strings->len);
+
+    ok = g_file_set_contents (filename, output->str, output->len, error);
+
+    g_string_free (output, TRUE);
+    g_string_free (strings, TRUE);
+    g_hash_table_destroy (offsets);
+    g_ptr_array_free (checksums, TRUE);
+    g_ptr_array_free (paths, TRUE);
+    g_ptr_array_free (files, TRUE);
+    g_ptr_array_free (rules, TRUE);
+
+    return ok;
+}
+
+static void
+ibus_m17n_engines_cache_add_stamp (GVariantBuilder *builder,
+                                   const gchar     *path)
+{
+    GStatBuf buf;
+
+    if (g_stat (path, &buf) == 0)
+        g_variant_builder_add (builder, "(sxt)",
+                               path,
+                               (gint64) buf.st_mtime,
+                               (guint64) buf.st_size);
+    else
+        g_variant_builder_add (builder, "(sxt)",
+                               path,
+                               G_GINT64_CONSTANT (-1),
+                               G_GUINT64_CONSTANT (0));
+}
+
+static gint
+ibus_m17n_compare_strings (gconstpointer a,
+                           gconstpointer b)
+{
+    return strcmp (*(const gchar **) a, *(const gchar **) b);
+}
+
+/* Stamp a database directory, its .mim files and its icons.  Editing
+   a .mim file in place does not change the mtime of the directory. */
+static void
+ibus_m17n_engines_cache_add_dir_stamps (GVariantBuilder *builder,
+                                        const gchar     *dirname)
+{
+    GDir *dir;
+    GPtrArray *paths;
+    const gchar *name;
+    gchar *icons;
+    guint i;
+
+    ibus_m17n_engines_cache_add_stamp (builder, dirname);
+
+    dir = g_dir_open (dirname, 0, NULL);
+    if (dir == NULL)
+        return;
+
+    paths = g_ptr_array_new_with_free_func (g_free);
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        if (g_str_has_suffix (name, ".mim"))
+            g_ptr_array_add (paths, g_build_filename (dirname, name, NULL));
+    }
+    g_dir_close (dir);
+
+    /* readdir() order is not stable */
+    g_ptr_array_sort (paths, ibus_m17n_compare_strings);
+    for (i = 0; i < paths->len; i++)
+        ibus_m17n_engines_cache_add_stamp (builder, paths->pdata[i]);
+    g_ptr_array_free (paths, TRUE);
+
+    icons = g_build_filename (dirname, "icons", NULL);
+    ibus_m17n_engines_cache_add_stamp (builder, icons);
+    g_free (icons);
+}
+
+/* Return the state of the files the engine list is derived from */
+static GVariant *
+ibus_m17n_engines_cache_get_stamps (void)
+{
+    GVariantBuilder builder;
+    GPtrArray *sources;
+    gchar **dirs, **dir;
+    gchar *filename;
+    guint i;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sxt)"));
+
+    dirs = ibus_m17n_mim_get_db_dirs ();
+    for (dir = dirs; *dir != NULL; dir++)
+        ibus_m17n_engines_cache_add_dir_stamps (&builder, *dir);
+    g_strfreev (dirs);
+
+    /* default.xml and the override files, an added or removed
+       override changes the list. */
+    sources = ibus_m17n_engine_config_get_sources ();
+    for (i = 0; i < sources->len; i++) {
+        filename = ibus_m17n_get_pkgdata_filename (g_ptr_array_index (sources, i));
+        ibus_m17n_engines_cache_add_stamp (&builder, filename);
+        g_free (filename);
+    }
+    g_ptr_array_free (sources, TRUE);
+    filename = ibus_m17n_get_pkgdata_filename ("default.bin");
+    ibus_m17n_engines_cache_add_stamp (&builder, filename);
+    g_free (filename);
+
+    return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+static gchar *
+ibus_m17n_engines_cache_get_filename (void)
+{
+    return g_build_filename (g_get_user_cache_dir (),
+                             "ibus-m17n",
+                             "engines.cache",
+                             NULL);
+}
+
+/* Descriptions are translated, so the cache is only valid for the
+   languages it was written for. */
+static gchar *
+ibus_m17n_engines_cache_get_languages (void)
+{
+    return g_strjoinv (":", (gchar **) g_get_language_names ());
+}
+
+static gboolean
+ibus_m17n_load_engines_cache (GVariant  *stamps,
+                              GList    **engines)
+{
+    GVariant *cache, *cached_stamps, *descs, *desc;
+    GVariantIter iter;
+    const gchar *version, *languages;
+    gchar *filename, *contents, *current_languages;
+    gsize length;
+    guint32 format;
+    gboolean valid;
+
+    *engines = NULL;
+
+    filename = ibus_m17n_engines_cache_get_filename ();
+    valid = g_file_get_contents (filename, &contents, &length, NULL);
+    g_free (filename);
+    if (!valid)
+        return FALSE;
+
+    cache = g_variant_new_from_data (G_VARIANT_TYPE (ENGINES_CACHE_TYPE),
+                                     contents,
+                                     length,
+                                     FALSE,
+                                     g_free,
+                                     contents);
+    g_variant_ref_sink (cache);
+    g_variant_get (cache, "(u&s&s@a(sxt)@av)",
+                   &format, &version, &languages, &cached_stamps, &descs);
+
+    current_languages = ibus_m17n_engines_cache_get_languages ();
+    valid = format == ENGINES_CACHE_VERSION &&
+        g_strcmp0 (version, PACKAGE_VERSION) == 0 &&
+        g_strcmp0 (languages, current_languages) == 0 &&
+        g_variant_equal (cached_stamps, stamps);
+    g_free (current_languages);
+
+    if (valid) {
+        g_variant_iter_init (&iter, descs);
+        while (g_variant_iter_next (&iter, "v", &desc)) {
+            IBusSerializable *engine = ibus_serializable_deserialize (desc);
+
+            g_variant_unref (desc);
+            if (!IBUS_IS_ENGINE_DESC (engine)) {
+                if (engine)
+                    g_object_unref (engine);
+                valid = FALSE;
+                break;
+            }
+            *engines = g_list_prepend (*engines, engine);
+        }
+        *engines = g_list_reverse (*engines);
+        if (!valid) {
+            g_list_free_full (*engines, g_object_unref);
+            *engines = NULL;
+        }
+    }
+
+    g_variant_unref (cached_stamps);
+    g_variant_unref (descs);
+    g_variant_unref (cache);
+
+    return valid;
+}
+
+static void
+ibus_m17n_save_engines_cache (GVariant *stamps,
+                              GList    *engines)
+{
+    GVariantBuilder builder;
+    GVariant *cache;
+    GList *p;
+    GError *error = NULL;
+    gchar *filename, *dirname, *languages;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("av"));
+    for (p = engines; p != NULL; p = p->next) {
+        g_variant_builder_add (&builder, "v",
+                               ibus_serializable_serialize (p->data));
+    }
+
+    languages = ibus_m17n_engines_cache_get_languages ();
+    cache = g_variant_new ("(uss@a(sxt)av)",
+                           ENGINES_CACHE_VERSION,
+                           PACKAGE_VERSION,
+                           languages,
+                           stamps,
+                           &builder);
+    g_variant_ref_sink (cache);
+    g_free (languages);
+
+    filename = ibus_m17n_engines_cache_get_filename ();
+    dirname = g_path_get_dirname (filename);
+    g_mkdir_with_parents (dirname, 0700);
+    if (!g_file_set_contents (filename,
+                              g_variant_get_data (cache),
+                              g_variant_get_size (cache),
+                              &error)) {
+        g_warning ("can't write %s: %s", filename, error->message);
+        g_error_free (error);
+    }
+    g_free (dirname);
+    g_free (filename);
+    g_variant_unref (cache);
+}
+
 IBusComponent *
 ibus_m17n_get_component (void)
 {
     GList *engines, *p;
     IBusComponent *component;
-    XMLNode *node;
-    const gchar *pkgdatadir;
-    gchar *default_xml;
+    GVariant *stamps;
 
     component = ibus_component_new ("org.freedesktop.IBus.M17n",
                                     N_("M17N"),
@@ -356,39 +1391,16 @@ ibus_m17n_get_component (void)
                                     "",
                                     PACKAGE_NAME);
 
-    pkgdatadir = g_getenv ("IBUS_M17N_PKGDATADIR");
-    if (pkgdatadir == NULL)
-        pkgdatadir = PKGDATADIR;
-    default_xml = g_build_filename (pkgdatadir, "default.xml", NULL);
-
-    node = ibus_xml_parse_file (default_xml);
-    if (node && g_strcmp0 (node->name, "engines") == 0) {
-        for (p = node->sub_nodes; p != NULL; p = p->next) {
-            XMLNode *sub_node = p->data;
-            EngineConfigNode *cnode;
+    ibus_m17n_engine_config_load ();
 
-            if (g_strcmp0 (sub_node->name, "engine") != 0) {
-                g_warning ("<engines> element contains invalid element <%s>",
-                           sub_node->name);
-                continue;
-            }
-
-            cnode = g_slice_new0 (EngineConfigNode);
-            if (!ibus_m17n_engine_config_parse_xml_node (cnode, sub_node)) {
-                g_slice_free (EngineConfigNode, cnode);
-                continue;
-            }
-            config_list = g_slist_prepend (config_list, cnode);
-        }
-        config_list = g_slist_reverse (config_list);
-    } else
-        g_warning ("failed to parse %s", default_xml);
-    if (node)
-        ibus_xml_free (node);
-
-    g_free (default_xml);
-
-    engines = ibus_m17n_list_engines ();
+    /* Listing the engines makes m17n-lib load every input method, use
+       the result of the last run while the database is unchanged. */
+    stamps = ibus_m17n_engines_cache_get_stamps ();
+    if (!ibus_m17n_load_engines_cache (stamps, &engines)) {
+        engines = ibus_m17n_list_engines ();
+        ibus_m17n_save_engines_cache (stamps, engines);
+    }
+    g_variant_unref (stamps);
 
     for (p = engines; p != NULL; p = p->next)
         ibus_component_add_engine (component, p->data);
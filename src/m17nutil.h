@@ -23,6 +23,9 @@ struct _IBusM17NEngineConfig {
     /* keyboard layout */
     gchar *layout;
 
+    /* layout keys are translated to with use-us-layout or AltGr */
+    gchar *reference_layout;
+
     /* whether to highlight preedit */
     gboolean preedit_highlight;
 };
@@ -34,10 +37,17 @@ void           ibus_m17n_init              (IBusBus     *bus);
 GList         *ibus_m17n_list_engines      (void);
 IBusComponent *ibus_m17n_get_component     (void);
 gchar         *ibus_m17n_mtext_to_utf8     (MText       *text);
+void           ibus_m17n_mtext_append_utf8 (GString     *string,
+                                            MText       *text);
+IBusText      *ibus_m17n_text_new_from_mtext
+                                           (MText       *text);
 gunichar      *ibus_m17n_mtext_to_ucs4     (MText       *text,
                                             glong       *nchars);
 guint          ibus_m17n_parse_color       (const gchar *hex);
 IBusM17NEngineConfig
               *ibus_m17n_get_engine_config (const gchar *engine_name);
 void           ibus_m17n_engine_config_free (IBusM17NEngineConfig *config);
+gboolean       ibus_m17n_config_compile    (gchar      **xml_files,
+                                            const gchar *filename,
+                                            GError     **error);
 #endif
@@ -3,11 +3,14 @@
 #include <config.h>
 #endif
 
+#include <glib-unix.h>
 #include <ibus.h>
 #include <locale.h>
+#include <signal.h>
 #include <m17n.h>
 #include "engine.h"
 #include "m17nutil.h"
+#include "trace.h"
 
 static IBusBus *bus = NULL;
 static IBusFactory *factory = NULL;
@@ -16,12 +19,18 @@ static IBusFactory *factory = NULL;
 static gboolean xml = FALSE;
 static gboolean ibus = FALSE;
 static gboolean verbose = FALSE;
+static gboolean trace = FALSE;
+static gint im_idle_timeout = -1;
+static gint im_memory_budget = -1;
 
 static const GOptionEntry entries[] =
 {
     { "xml", 'x', 0, G_OPTION_ARG_NONE, &xml, "generate xml for engines", NULL },
     { "ibus", 'i', 0, G_OPTION_ARG_NONE, &ibus, "component is executed by ibus", NULL },
     { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "verbose", NULL },
+    { "trace", 't', 0, G_OPTION_ARG_NONE, &trace, "record key event timings, dump them on SIGUSR1", NULL },
+    { "im-idle-timeout", 0, 0, G_OPTION_ARG_INT, &im_idle_timeout, "close input methods unused for SECONDS except the recently used ones opened at startup, 0 to keep them", "SECONDS" },
+    { "im-memory-budget", 0, 0, G_OPTION_ARG_INT, &im_memory_budget, "close unused input methods beyond about KIB of estimated memory", "KIB" },
     { NULL },
 };
 
@@ -35,14 +44,83 @@ ibus_disconnected_cb (IBusBus  *bus,
 }
 
 
+static gboolean
+print_im_stats_cb (gpointer user_data)
+{
+    ibus_m17n_engine_print_im_stats ();
+    return G_SOURCE_CONTINUE;
+}
+
+/* Options take precedence over the environment, which is all there
+   is when ibus starts the component. */
+static void
+set_im_limits (void)
+{
+    const gchar *env;
+    guint idle_timeout = IBUS_M17N_IM_IDLE_TIMEOUT;
+    gsize memory_budget = 0;
+
+    env = g_getenv ("IBUS_M17N_IM_IDLE_TIMEOUT");
+    if (env != NULL && *env != '\0')
+        idle_timeout = g_ascii_strtoull (env, NULL, 10);
+    env = g_getenv ("IBUS_M17N_IM_MEMORY_BUDGET");
+    if (env != NULL && *env != '\0')
+        memory_budget = g_ascii_strtoull (env, NULL, 10) * 1024;
+
+    if (im_idle_timeout >= 0)
+        idle_timeout = im_idle_timeout;
+    if (im_memory_budget >= 0)
+        memory_budget = (gsize) im_memory_budget * 1024;
+
+    ibus_m17n_engine_set_im_limits (idle_timeout, memory_budget);
+}
+
+#if IBUS_CHECK_VERSION(1,5,0)
+/* Engine types are registered when an engine is first asked for,
+   instead of for every installed input method at startup. */
+static IBusEngine *
+create_engine_cb (IBusFactory *factory,
+                  const gchar *engine_name,
+                  gpointer     user_data)
+{
+    static guint engine_id = 0;
+    IBusEngine *engine;
+    gchar *object_path;
+    GType type;
+
+    type = ibus_m17n_engine_get_type_for_name (engine_name);
+    if (type == G_TYPE_INVALID) {
+        g_debug ("Can not create engine type for %s", engine_name);
+        return NULL;
+    }
+
+    object_path = g_strdup_printf ("/org/freedesktop/IBus/Engine/M17N/%u",
+                                   ++engine_id);
+    engine = ibus_engine_new_with_type (type,
+                                        engine_name,
+                                        object_path,
+                                        ibus_bus_get_connection (bus));
+    g_free (object_path);
+
+    return engine;
+}
+#endif  /* IBUS_CHECK_VERSION(1,5,0) */
+
 static void
 start_component (void)
 {
-    GList *engines, *p;
     IBusComponent *component;
+#if !IBUS_CHECK_VERSION(1,5,0)
+    GList *engines, *p;
+#endif  /* !IBUS_CHECK_VERSION(1,5,0) */
 
     ibus_init ();
 
+    ibus_m17n_trace_init (trace);
+
+    set_im_limits ();
+    g_unix_signal_add (SIGUSR2, print_im_stats_cb, NULL);
+
     bus = ibus_bus_new ();
     g_signal_connect (bus, "disconnected", G_CALLBACK (ibus_disconnected_cb), NULL);
     ibus_m17n_init (bus);
@@ -51,6 +129,10 @@ start_component (void)
 
     factory = ibus_factory_new (ibus_bus_get_connection (bus));
 
+#if IBUS_CHECK_VERSION(1,5,0)
+    g_signal_connect (factory, "create-engine",
+                      G_CALLBACK (create_engine_cb), NULL);
+#else
     engines = ibus_component_get_engines (component);
     for (p = engines; p != NULL; p = p->next) {
         IBusEngineDesc *engine = (IBusEngineDesc *)p->data;
@@ -67,6 +149,7 @@ start_component (void)
         }
         ibus_factory_add_engine (factory, engine_name, type);
     }
+#endif  /* !IBUS_CHECK_VERSION(1,5,0) */
 
     if (ibus) {
         ibus_bus_request_name (bus, "org.freedesktop.IBus.M17N", 0);
@@ -77,6 +160,8 @@ start_component (void)
 
     g_object_unref (component);
 
+    ibus_m17n_engine_prewarm ();
+
     ibus_main ();
 }
 
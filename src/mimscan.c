@@ -0,0 +1,988 @@
+/* vim:set et sts=4: */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "mimscan.h"
+
+/* Read just enough of a .mim file for listing the input method,
+   without loading it through m17n-lib.  The header forms come before
+   the first (map ...) or (state ...) form, which is where scanning
+   stops. */
+
+#ifndef M17N_DB_DIR
+#define M17N_DB_DIR "/usr/share/m17n"
+#endif
+
+/* gettext domain of the m17n database */
+#define M17N_DB_DOMAIN "m17n-db"
+
+typedef enum {
+    MIM_TOKEN_EOF,
+    MIM_TOKEN_ERROR,
+    MIM_TOKEN_OPEN,
+    MIM_TOKEN_CLOSE,
+    MIM_TOKEN_STRING,
+    MIM_TOKEN_SYMBOL,
+    MIM_TOKEN_CHAR
+} MimToken;
+
+struct _MimScanner {
+    FILE *fp;
+    /* text of the last string, symbol or character token */
+    GString *text;
+};
+typedef struct _MimScanner MimScanner;
+
+static gboolean
+mim_scanner_is_delimiter (gint c)
+{
+    return g_ascii_isspace (c) || c == '(' || c == ')' || c == '"' || c == ';';
+}
+
+static MimToken
+mim_scanner_next (MimScanner *scanner)
+{
+    FILE *fp = scanner->fp;
+    gint c;
+
+    g_string_truncate (scanner->text, 0);
+
+    for (;;) {
+        c = getc (fp);
+        if (c == EOF)
+            return MIM_TOKEN_EOF;
+        if (c == ';') {
+            while ((c = getc (fp)) != EOF && c != '\n')
+                ;
+            continue;
+        }
+        if (!g_ascii_isspace (c))
+            break;
+    }
+
+    switch (c) {
+    case '(':
+        return MIM_TOKEN_OPEN;
+
+    case ')':
+        return MIM_TOKEN_CLOSE;
+
+    case '"':
+        while ((c = getc (fp)) != '"') {
+            if (c == EOF)
+                return MIM_TOKEN_ERROR;
+            if (c == '\\') {
+                c = getc (fp);
+                if (c == EOF)
+                    return MIM_TOKEN_ERROR;
+                if (c == 'n')
+                    c = '\n';
+                else if (c == 't')
+                    c = '\t';
+            }
+            g_string_append_c (scanner->text, c);
+        }
+        return MIM_TOKEN_STRING;
+
+    case '?':
+        /* character literal like ?a, ?\( or a multibyte character */
+        c = getc (fp);
+        if (c == '\\')
+            c = getc (fp);
+        if (c == EOF)
+            return MIM_TOKEN_ERROR;
+        g_string_append_c (scanner->text, c);
+        while ((c = getc (fp)) != EOF && (c & 0xC0) == 0x80)
+            g_string_append_c (scanner->text, c);
+        if (c != EOF)
+            ungetc (c, fp);
+        return MIM_TOKEN_CHAR;
+
+    default:
+        do {
+            if (c == '\\') {
+                c = getc (fp);
+                if (c == EOF)
+                    return MIM_TOKEN_ERROR;
+            }
+            g_string_append_c (scanner->text, c);
+            c = getc (fp);
+        } while (c != EOF && !mim_scanner_is_delimiter (c));
+        if (c != EOF)
+            ungetc (c, fp);
+        return MIM_TOKEN_SYMBOL;
+    }
+}
+
+/* Skip to the end of the list whose opening parenthesis has been
+   read. */
+static gboolean
+mim_scanner_skip_list (MimScanner *scanner)
+{
+    gint depth = 1;
+
+    while (depth > 0) {
+        switch (mim_scanner_next (scanner)) {
+        case MIM_TOKEN_OPEN:
+            depth++;
+            break;
+        case MIM_TOKEN_CLOSE:
+            depth--;
+            break;
+        case MIM_TOKEN_EOF:
+        case MIM_TOKEN_ERROR:
+            return FALSE;
+        default:
+            break;
+        }
+    }
+    return TRUE;
+}
+
+static gchar *
+mim_translate (const gchar *msgid)
+{
+    const gchar *msgstr = g_dgettext (M17N_DB_DOMAIN, msgid);
+
+    /* The translation is in the encoding of the locale. */
+    if (msgstr != msgid && !g_utf8_validate (msgstr, -1, NULL))
+        msgstr = msgid;
+    return g_strdup (msgstr);
+}
+
+/* Read a text which is a string, (_ "string") or nil */
+static gboolean
+mim_scanner_read_text (MimScanner  *scanner,
+                       gchar      **text)
+{
+    switch (mim_scanner_next (scanner)) {
+    case MIM_TOKEN_STRING:
+        *text = g_strdup (scanner->text->str);
+        return TRUE;
+
+    case MIM_TOKEN_SYMBOL:
+        return strcmp (scanner->text->str, "nil") == 0;
+
+    case MIM_TOKEN_OPEN:
+        if (mim_scanner_next (scanner) != MIM_TOKEN_SYMBOL ||
+            strcmp (scanner->text->str, "_") != 0 ||
+            mim_scanner_next (scanner) != MIM_TOKEN_STRING)
+            return FALSE;
+        *text = mim_translate (scanner->text->str);
+        return mim_scanner_next (scanner) == MIM_TOKEN_CLOSE;
+
+    default:
+        return FALSE;
+    }
+}
+
+/* (input-method LANG NAME ...) */
+static gboolean
+mim_scan_input_method (MimScanner        *scanner,
+                       IBusM17NMimHeader *header)
+{
+    if (mim_scanner_next (scanner) != MIM_TOKEN_SYMBOL)
+        return FALSE;
+    header->lang = g_strdup (scanner->text->str);
+
+    if (mim_scanner_next (scanner) != MIM_TOKEN_SYMBOL)
+        return FALSE;
+    header->name = g_strdup (scanner->text->str);
+
+    return mim_scanner_skip_list (scanner);
+}
+
+/* (variable (NAME DESCRIPTION VALUE VALID-VALUE ...) ...) */
+static gboolean
+mim_scan_variable (MimScanner        *scanner,
+                   IBusM17NMimHeader *header)
+{
+    for (;;) {
+        switch (mim_scanner_next (scanner)) {
+        case MIM_TOKEN_CLOSE:
+            return TRUE;
+
+        case MIM_TOKEN_OPEN:
+            if (mim_scanner_next (scanner) != MIM_TOKEN_SYMBOL)
+                return FALSE;
+            if (strcmp (scanner->text->str, "candidates-charset") == 0)
+                header->has_candidates_charset = TRUE;
+            if (!mim_scanner_skip_list (scanner))
+                return FALSE;
+            break;
+
+        default:
+            return FALSE;
+        }
+    }
+}
+
+static gchar *
+mim_find_icon (const gchar *lang,
+               const gchar *name)
+{
+    gchar **dirs, **dir;
+    gchar *basename, *icon = NULL;
+
+    if (strcmp (lang, "t") == 0)
+        basename = g_strdup_printf ("%s.png", name);
+    else
+        basename = g_strdup_printf ("%s-%s.png", lang, name);
+
+    dirs = ibus_m17n_mim_get_db_dirs ();
+    for (dir = dirs; *dir != NULL && icon == NULL; dir++) {
+        gchar *path = g_build_filename (*dir, "icons", basename, NULL);
+
+        if (g_file_test (path, G_FILE_TEST_IS_REGULAR))
+            icon = path;
+        else
+            g_free (path);
+    }
+    g_strfreev (dirs);
+    g_free (basename);
+
+    return icon;
+}
+
+IBusM17NMimHeader *
+ibus_m17n_mim_header_scan (const gchar *filename)
+{
+    MimScanner scanner;
+    IBusM17NMimHeader *header;
+    gboolean ok = TRUE;
+    gboolean done = FALSE;
+
+    scanner.fp = g_fopen (filename, "r");
+    if (scanner.fp == NULL)
+        return NULL;
+    scanner.text = g_string_sized_new (64);
+
+    header = g_slice_new0 (IBusM17NMimHeader);
+
+    while (ok && !done) {
+        const gchar *head;
+
+        switch (mim_scanner_next (&scanner)) {
+        case MIM_TOKEN_EOF:
+            done = TRUE;
+            continue;
+        case MIM_TOKEN_OPEN:
+            break;
+        default:
+            ok = FALSE;
+            continue;
+        }
+
+        if (mim_scanner_next (&scanner) != MIM_TOKEN_SYMBOL) {
+            ok = FALSE;
+            continue;
+        }
+        head = scanner.text->str;
+
+        if (strcmp (head, "input-method") == 0) {
+            ok = mim_scan_input_method (&scanner, header);
+        }
+        else if (strcmp (head, "description") == 0) {
+            g_free (header->description);
+            header->description = NULL;
+            ok = mim_scanner_read_text (&scanner, &header->description) &&
+                mim_scanner_skip_list (&scanner);
+        }
+        else if (strcmp (head, "title") == 0) {
+            g_free (header->title);
+            header->title = NULL;
+            ok = mim_scanner_read_text (&scanner, &header->title) &&
+                mim_scanner_skip_list (&scanner);
+        }
+        else if (strcmp (head, "variable") == 0) {
+            ok = mim_scan_variable (&scanner, header);
+        }
+        else if (strcmp (head, "map") == 0 || strcmp (head, "state") == 0) {
+            done = TRUE;
+        }
+        else {
+            ok = mim_scanner_skip_list (&scanner);
+        }
+    }
+
+    fclose (scanner.fp);
+    g_string_free (scanner.text, TRUE);
+
+    if (!ok || header->lang == NULL || header->name == NULL) {
+        ibus_m17n_mim_header_free (header);
+        return NULL;
+    }
+
+    header->icon = mim_find_icon (header->lang, header->name);
+
+    return header;
+}
+
+void
+ibus_m17n_mim_header_free (IBusM17NMimHeader *header)
+{
+    g_free (header->lang);
+    g_free (header->name);
+    g_free (header->title);
+    g_free (header->description);
+    g_free (header->icon);
+    g_slice_free (IBusM17NMimHeader, header);
+}
+
+gchar **
+ibus_m17n_mim_get_db_dirs (void)
+{
+    GPtrArray *dirs;
+    const gchar *m17ndir;
+
+    dirs = g_ptr_array_new ();
+    g_ptr_array_add (dirs, g_build_filename (g_get_home_dir (), ".m17n.d", NULL));
+    m17ndir = g_getenv ("M17NDIR");
+    if (m17ndir != NULL && strcmp (m17ndir, M17N_DB_DIR) != 0)
+        g_ptr_array_add (dirs, g_strdup (m17ndir));
+    g_ptr_array_add (dirs, g_strdup (M17N_DB_DIR));
+    g_ptr_array_add (dirs, NULL);
+
+    return (gchar **) g_ptr_array_free (dirs, FALSE);
+}
+
+static gint
+mim_compare_strings (gconstpointer a,
+                     gconstpointer b)
+{
+    return strcmp (*(const gchar **) a, *(const gchar **) b);
+}
+
+GHashTable *
+ibus_m17n_mim_scan_db_dirs (void)
+{
+    GHashTable *headers;
+    gchar **dirs, **dir;
+
+    headers = g_hash_table_new_full (g_str_hash,
+                                     g_str_equal,
+                                     g_free,
+                                     (GDestroyNotify) ibus_m17n_mim_header_free);
+
+    dirs = ibus_m17n_mim_get_db_dirs ();
+    for (dir = dirs; *dir != NULL; dir++) {
+        GDir *gdir;
+        GPtrArray *names;
+        const gchar *name;
+        guint i;
+
+        gdir = g_dir_open (*dir, 0, NULL);
+        if (gdir == NULL)
+            continue;
+
+        names = g_ptr_array_new_with_free_func (g_free);
+        while ((name = g_dir_read_name (gdir)) != NULL) {
+            if (g_str_has_suffix (name, ".mim"))
+                g_ptr_array_add (names, g_strdup (name));
+        }
+        g_dir_close (gdir);
+        g_ptr_array_sort (names, mim_compare_strings);
+
+        for (i = 0; i < names->len; i++) {
+            IBusM17NMimHeader *header;
+            gchar *path, *key;
+
+            path = g_build_filename (*dir, names->pdata[i], NULL);
+            header = ibus_m17n_mim_header_scan (path);
+            g_free (path);
+            if (header == NULL)
+                continue;
+
+            /* The first directory has priority. */
+            key = g_strdup_printf ("%s:%s", header->lang, header->name);
+            if (g_hash_table_contains (headers, key)) {
+                g_free (key);
+                ibus_m17n_mim_header_free (header);
+                continue;
+            }
+            g_hash_table_insert (headers, key, header);
+        }
+        g_ptr_array_free (names, TRUE);
+    }
+    g_strfreev (dirs);
+
+    return headers;
+}
+
+gchar *
+ibus_m17n_mim_find_file (const gchar *lang,
+                         const gchar *name)
+{
+    gchar **dirs, **dir;
+    gchar *basename, *filename = NULL;
+
+    if (strcmp (lang, "t") == 0)
+        basename = g_strdup_printf ("%s.mim", name);
+    else
+        basename = g_strdup_printf ("%s-%s.mim", lang, name);
+
+    dirs = ibus_m17n_mim_get_db_dirs ();
+    for (dir = dirs; *dir != NULL && filename == NULL; dir++) {
+        gchar *path = g_build_filename (*dir, basename, NULL);
+        IBusM17NMimHeader *header = ibus_m17n_mim_header_scan (path);
+
+        if (header != NULL &&
+            strcmp (header->lang, lang) == 0 &&
+            strcmp (header->name, name) == 0)
+            filename = path;
+        else
+            g_free (path);
+        if (header != NULL)
+            ibus_m17n_mim_header_free (header);
+    }
+    g_strfreev (dirs);
+    g_free (basename);
+
+    return filename;
+}
+
+/* A form read completely, for the parts of a .mim file which need
+   more than one pass */
+struct _MimSexp {
+    MimToken type;
+    /* text of a string, symbol or character */
+    gchar *text;
+    /* MimSexp items of a list */
+    GPtrArray *items;
+};
+typedef struct _MimSexp MimSexp;
+
+static void
+mim_sexp_free (gpointer data)
+{
+    MimSexp *sexp = data;
+
+    g_free (sexp->text);
+    if (sexp->items)
+        g_ptr_array_free (sexp->items, TRUE);
+    g_slice_free (MimSexp, sexp);
+}
+
+/* Read the rest of a form whose first token is TOKEN */
+static MimSexp *
+mim_scanner_read_sexp (MimScanner *scanner,
+                       MimToken    token)
+{
+    MimSexp *sexp;
+
+    switch (token) {
+    case MIM_TOKEN_STRING:
+    case MIM_TOKEN_SYMBOL:
+    case MIM_TOKEN_CHAR:
+        sexp = g_slice_new0 (MimSexp);
+        sexp->type = token;
+        sexp->text = g_strdup (scanner->text->str);
+        return sexp;
+
+    case MIM_TOKEN_OPEN:
+        sexp = g_slice_new0 (MimSexp);
+        sexp->type = token;
+        sexp->items = g_ptr_array_new_with_free_func (mim_sexp_free);
+        for (;;) {
+            MimSexp *item;
+
+            token = mim_scanner_next (scanner);
+            if (token == MIM_TOKEN_CLOSE)
+                return sexp;
+            item = mim_scanner_read_sexp (scanner, token);
+            if (item == NULL) {
+                mim_sexp_free (sexp);
+                return NULL;
+            }
+            g_ptr_array_add (sexp->items, item);
+        }
+
+    default:
+        return NULL;
+    }
+}
+
+#define MIM_SEXP_ITEM(sexp, i) ((MimSexp *) g_ptr_array_index ((sexp)->items, (i)))
+
+static gboolean
+mim_sexp_is_list (MimSexp *sexp)
+{
+    return sexp->type == MIM_TOKEN_OPEN && sexp->items->len > 0;
+}
+
+static gboolean
+mim_sexp_is_symbol (MimSexp     *sexp,
+                    const gchar *text)
+{
+    return sexp->type == MIM_TOKEN_SYMBOL &&
+        (text == NULL || strcmp (sexp->text, text) == 0);
+}
+
+/* Read all forms of FILENAME, which must be lists starting with a
+   symbol.  Return NULL if the file can not be read. */
+static GPtrArray *
+mim_read_forms (const gchar *filename)
+{
+    MimScanner scanner;
+    GPtrArray *forms;
+    MimToken token;
+    gboolean ok = TRUE;
+
+    scanner.fp = g_fopen (filename, "r");
+    if (scanner.fp == NULL)
+        return NULL;
+    scanner.text = g_string_sized_new (64);
+
+    forms = g_ptr_array_new_with_free_func (mim_sexp_free);
+    while (ok && (token = mim_scanner_next (&scanner)) != MIM_TOKEN_EOF) {
+        MimSexp *form = mim_scanner_read_sexp (&scanner, token);
+
+        if (form == NULL || !mim_sexp_is_list (form) ||
+            !mim_sexp_is_symbol (MIM_SEXP_ITEM (form, 0), NULL)) {
+            if (form != NULL)
+                mim_sexp_free (form);
+            ok = FALSE;
+        }
+        else {
+            g_ptr_array_add (forms, form);
+        }
+    }
+    fclose (scanner.fp);
+    g_string_free (scanner.text, TRUE);
+
+    if (!ok) {
+        g_ptr_array_free (forms, TRUE);
+        return NULL;
+    }
+    return forms;
+}
+
+/* Key names of m17n-lib for printable ASCII are the characters
+   themselves.  Other characters are not supported. */
+static gboolean
+mim_key_is_ascii (const gchar *text)
+{
+    return text[0] >= 0x20 && text[0] < 0x7f && text[1] == '\0';
+}
+
+/* Append the text inserted by the map action ACTION to OUTPUT */
+static gboolean
+mim_direct_map_append_action (GString *output,
+                              MimSexp *action)
+{
+    gchar *end;
+    guint64 c;
+
+    switch (action->type) {
+    case MIM_TOKEN_STRING:
+    case MIM_TOKEN_CHAR:
+        g_string_append (output, action->text);
+        return TRUE;
+
+    case MIM_TOKEN_SYMBOL:
+        /* a character code, anything else refers to a variable */
+        if (g_str_has_prefix (action->text, "0x") ||
+            g_str_has_prefix (action->text, "0X"))
+            c = g_ascii_strtoull (action->text + 2, &end, 16);
+        else
+            c = g_ascii_strtoull (action->text, &end, 10);
+        if (end == action->text || *end != '\0' ||
+            !g_unichar_validate ((gunichar) c))
+            return FALSE;
+        g_string_append_unichar (output, (gunichar) c);
+        return TRUE;
+
+    default:
+        /* candidates or a command */
+        return FALSE;
+    }
+}
+
+/* Return the set of the names of the commands declared in FORMS,
+   or NULL if a declaration is malformed */
+static GHashTable *
+mim_get_command_names (GPtrArray *forms)
+{
+    GHashTable *commands = g_hash_table_new (g_str_hash, g_str_equal);
+    guint i, j;
+
+    /* (command (NAME [DESCRIPTION] KEYSEQ ...) ...) */
+    for (i = 0; i < forms->len; i++) {
+        MimSexp *form = g_ptr_array_index (forms, i);
+
+        if (!mim_sexp_is_symbol (MIM_SEXP_ITEM (form, 0), "command"))
+            continue;
+        for (j = 1; j < form->items->len; j++) {
+            MimSexp *command = MIM_SEXP_ITEM (form, j);
+
+            if (!mim_sexp_is_list (command) ||
+                !mim_sexp_is_symbol (MIM_SEXP_ITEM (command, 0), NULL)) {
+                g_hash_table_destroy (commands);
+                return NULL;
+            }
+            g_hash_table_add (commands, MIM_SEXP_ITEM (command, 0)->text);
+        }
+    }
+    return commands;
+}
+
+/* Append the key names of the key sequence KEYSEQ to KEYS.  Keys
+   naming one of COMMANDS stand for its bindings, which the user
+   configuration can change, so they are not supported. */
+static gboolean
+mim_direct_map_add_keys (GPtrArray  *keys,
+                         GHashTable *commands,
+                         MimSexp    *keyseq)
+{
+    const gchar *p;
+    guint i;
+
+    switch (keyseq->type) {
+    case MIM_TOKEN_STRING:
+        for (p = keyseq->text; *p; p++) {
+            if (*p < 0x20 || *p >= 0x7f)
+                return FALSE;
+            g_ptr_array_add (keys, g_strndup (p, 1));
+        }
+        return keys->len > 0;
+
+    case MIM_TOKEN_OPEN:
+        for (i = 0; i < keyseq->items->len; i++) {
+            MimSexp *key = MIM_SEXP_ITEM (keyseq, i);
+
+            if (key->type == MIM_TOKEN_SYMBOL && g_ascii_isdigit (key->text[0])) {
+                /* a character code */
+                GString *c = g_string_new (NULL);
+                gboolean ascii;
+
+                ascii = mim_direct_map_append_action (c, key) &&
+                    mim_key_is_ascii (c->str);
+                if (ascii)
+                    g_ptr_array_add (keys, g_strdup (c->str));
+                g_string_free (c, TRUE);
+                if (!ascii)
+                    return FALSE;
+                continue;
+            }
+            if (key->type == MIM_TOKEN_CHAR && !mim_key_is_ascii (key->text))
+                return FALSE;
+            if (key->type != MIM_TOKEN_CHAR && key->type != MIM_TOKEN_SYMBOL)
+                return FALSE;
+            if (key->type == MIM_TOKEN_SYMBOL &&
+                g_hash_table_contains (commands, key->text))
+                return FALSE;
+            g_ptr_array_add (keys, g_strdup (key->text));
+        }
+        return keys->len > 0;
+
+    default:
+        return FALSE;
+    }
+}
+
+/* (MAP-NAME (KEYSEQ MAP-ACTION ...) ...) */
+static gboolean
+mim_direct_map_add_map (IBusM17NDirectMap *map,
+                        GHashTable        *commands,
+                        MimSexp           *rules)
+{
+    GPtrArray *keys = g_ptr_array_new_with_free_func (g_free);
+    GString *output = g_string_new (NULL);
+    gboolean ok = TRUE;
+    guint i, j;
+
+    for (i = 1; i < rules->items->len && ok; i++) {
+        MimSexp *rule = MIM_SEXP_ITEM (rules, i);
+
+        if (!mim_sexp_is_list (rule) || rule->items->len < 2) {
+            ok = FALSE;
+            break;
+        }
+
+        g_ptr_array_set_size (keys, 0);
+        g_string_truncate (output, 0);
+        ok = mim_direct_map_add_keys (keys, commands, MIM_SEXP_ITEM (rule, 0));
+        for (j = 1; j < rule->items->len && ok; j++)
+            ok = mim_direct_map_append_action (output, MIM_SEXP_ITEM (rule, j));
+        if (ok)
+            ok = ibus_m17n_direct_map_add (map,
+                                           (const gchar **) keys->pdata,
+                                           keys->len,
+                                           output->str);
+    }
+
+    g_string_free (output, TRUE);
+    g_ptr_array_free (keys, TRUE);
+
+    return ok;
+}
+
+/* Return the names of the maps of the only state in STATES, whose
+   branches must not have actions */
+static GPtrArray *
+mim_direct_map_get_state_maps (MimSexp *states)
+{
+    MimSexp *state;
+    GPtrArray *names;
+    guint i;
+
+    /* (state (STATE-NAME [TITLE] (MAP-NAME) ...)) */
+    if (states->items->len != 2)
+        return NULL;
+    state = MIM_SEXP_ITEM (states, 1);
+    if (!mim_sexp_is_list (state))
+        return NULL;
+
+    names = g_ptr_array_new ();
+    for (i = 1; i < state->items->len; i++) {
+        MimSexp *branch = MIM_SEXP_ITEM (state, i);
+
+        if (i == 1 && branch->type == MIM_TOKEN_STRING)
+            continue;
+        if (branch->type != MIM_TOKEN_OPEN ||
+            branch->items->len != 1 ||
+            !mim_sexp_is_symbol (MIM_SEXP_ITEM (branch, 0), NULL)) {
+            g_ptr_array_free (names, TRUE);
+            return NULL;
+        }
+        g_ptr_array_add (names, MIM_SEXP_ITEM (branch, 0)->text);
+    }
+    return names;
+}
+
+IBusM17NDirectMap *
+ibus_m17n_mim_direct_map_load (const gchar *filename)
+{
+    GPtrArray *forms;
+    MimSexp *map_form = NULL, *state_form = NULL;
+    GPtrArray *state_maps = NULL;
+    GHashTable *commands = NULL;
+    IBusM17NDirectMap *map = NULL;
+    gboolean ok = TRUE;
+    gboolean has_input_method = FALSE;
+    guint i, j;
+
+    forms = mim_read_forms (filename);
+    if (forms == NULL)
+        return NULL;
+
+    for (i = 0; i < forms->len && ok; i++) {
+        MimSexp *form = g_ptr_array_index (forms, i);
+        const gchar *head = MIM_SEXP_ITEM (form, 0)->text;
+
+        if (strcmp (head, "input-method") == 0) {
+            /* (input-method LANG NAME ...), without a name the file
+               only defines commands or variables for others */
+            has_input_method = form->items->len >= 3 &&
+                !mim_sexp_is_symbol (MIM_SEXP_ITEM (form, 2), "nil");
+        }
+        else if (strcmp (head, "map") == 0 && map_form == NULL) {
+            map_form = form;
+        }
+        else if (strcmp (head, "state") == 0 && state_form == NULL) {
+            state_form = form;
+        }
+        /* Variables and commands only take effect through actions,
+           which are not supported anyway. */
+        else if (strcmp (head, "description") != 0 &&
+                 strcmp (head, "title") != 0 &&
+                 strcmp (head, "variable") != 0 &&
+                 strcmp (head, "command") != 0) {
+            ok = FALSE;
+        }
+    }
+    if (!has_input_method || map_form == NULL)
+        ok = FALSE;
+
+    if (ok) {
+        commands = mim_get_command_names (forms);
+        ok = commands != NULL;
+    }
+
+    /* Without a state, all maps are used in the init state. */
+    if (ok && state_form != NULL) {
+        state_maps = mim_direct_map_get_state_maps (state_form);
+        ok = state_maps != NULL;
+    }
+
+    if (ok) {
+        map = ibus_m17n_direct_map_new ();
+        for (i = 1; i < map_form->items->len && ok; i++) {
+            MimSexp *rules = MIM_SEXP_ITEM (map_form, i);
+            gboolean used = state_maps == NULL;
+
+            if (!mim_sexp_is_list (rules) ||
+                !mim_sexp_is_symbol (MIM_SEXP_ITEM (rules, 0), NULL)) {
+                ok = FALSE;
+                break;
+            }
+            for (j = 0; state_maps != NULL && j < state_maps->len; j++) {
+                if (strcmp (g_ptr_array_index (state_maps, j),
+                            MIM_SEXP_ITEM (rules, 0)->text) == 0)
+                    used = TRUE;
+            }
+            if (used)
+                ok = mim_direct_map_add_map (map, commands, rules);
+        }
+        if (ok)
+            ok = ibus_m17n_direct_map_compile (map);
+        if (!ok) {
+            ibus_m17n_direct_map_free (map);
+            map = NULL;
+        }
+    }
+
+    if (state_maps != NULL)
+        g_ptr_array_free (state_maps, TRUE);
+    if (commands != NULL)
+        g_hash_table_destroy (commands);
+    g_ptr_array_free (forms, TRUE);
+
+    return map;
+}
+
+/* Add the key names of the key sequence KEYSEQ to KEYS.  Return
+   FALSE if it refers to a command, whose keys can be changed by the
+   user configuration. */
+static gboolean
+mim_consumed_keys_add_keyseq (GHashTable *keys,
+                              GHashTable *commands,
+                              MimSexp    *keyseq)
+{
+    const gchar *p;
+    guint i;
+
+    switch (keyseq->type) {
+    case MIM_TOKEN_STRING:
+        for (p = keyseq->text; *p; p = g_utf8_next_char (p)) {
+            g_hash_table_add (keys, g_strndup (p, g_utf8_next_char (p) - p));
+        }
+        return TRUE;
+
+    case MIM_TOKEN_OPEN:
+        for (i = 0; i < keyseq->items->len; i++) {
+            MimSexp *key = MIM_SEXP_ITEM (keyseq, i);
+
+            if (key->type == MIM_TOKEN_SYMBOL && g_ascii_isdigit (key->text[0])) {
+                /* a character code */
+                GString *c = g_string_new (NULL);
+
+                if (!mim_direct_map_append_action (c, key)) {
+                    g_string_free (c, TRUE);
+                    return FALSE;
+                }
+                g_hash_table_add (keys, g_string_free (c, FALSE));
+                continue;
+            }
+            if (key->type == MIM_TOKEN_SYMBOL &&
+                g_hash_table_contains (commands, key->text))
+                return FALSE;
+            if (key->type != MIM_TOKEN_CHAR && key->type != MIM_TOKEN_SYMBOL)
+                return FALSE;
+            g_hash_table_add (keys, g_strdup (key->text));
+        }
+        return TRUE;
+
+    default:
+        return FALSE;
+    }
+}
+
+GHashTable *
+ibus_m17n_mim_consumed_keys_load (const gchar *filename)
+{
+    GPtrArray *forms;
+    GHashTable *keys, *commands;
+    gboolean ok = TRUE;
+    guint i, j, k;
+
+    forms = mim_read_forms (filename);
+    if (forms == NULL)
+        return NULL;
+
+    commands = mim_get_command_names (forms);
+    if (commands == NULL) {
+        g_ptr_array_free (forms, TRUE);
+        return NULL;
+    }
+    keys = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    for (i = 0; i < forms->len && ok; i++) {
+        MimSexp *form = g_ptr_array_index (forms, i);
+        const gchar *head = MIM_SEXP_ITEM (form, 0)->text;
+
+        if (strcmp (head, "map") == 0) {
+            /* (map (MAP-NAME (KEYSEQ MAP-ACTION ...) ...) ...) */
+            for (j = 1; j < form->items->len && ok; j++) {
+                MimSexp *rules = MIM_SEXP_ITEM (form, j);
+
+                if (!mim_sexp_is_list (rules)) {
+                    ok = FALSE;
+                    break;
+                }
+                for (k = 1; k < rules->items->len && ok; k++) {
+                    MimSexp *rule = MIM_SEXP_ITEM (rules, k);
+
+                    ok = mim_sexp_is_list (rule) &&
+                        mim_consumed_keys_add_keyseq (keys, commands,
+                                                      MIM_SEXP_ITEM (rule, 0));
+                }
+            }
+        }
+        else if (strcmp (head, "state") == 0) {
+            /* (state (STATE-NAME [TITLE] (MAP-NAME BRANCH-ACTION ...) ...) ...),
+               a nil map catches every key no other map matches. */
+            for (j = 1; j < form->items->len && ok; j++) {
+                MimSexp *state = MIM_SEXP_ITEM (form, j);
+
+                if (!mim_sexp_is_list (state)) {
+                    ok = FALSE;
+                    break;
+                }
+                for (k = 1; k < state->items->len && ok; k++) {
+                    MimSexp *branch = MIM_SEXP_ITEM (state, k);
+
+                    if (mim_sexp_is_list (branch) &&
+                        mim_sexp_is_symbol (MIM_SEXP_ITEM (branch, 0), "nil"))
+                        ok = FALSE;
+                }
+            }
+        }
+        else if (strcmp (head, "command") == 0) {
+            /* The default keys, in case a map refers to the command
+               by a key of the same name. */
+            for (j = 1; j < form->items->len; j++) {
+                MimSexp *command = MIM_SEXP_ITEM (form, j);
+
+                for (k = 1; k < command->items->len; k++) {
+                    MimSexp *keyseq = MIM_SEXP_ITEM (command, k);
+
+                    if (keyseq->type == MIM_TOKEN_OPEN)
+                        mim_consumed_keys_add_keyseq (keys, commands, keyseq);
+                }
+            }
+        }
+        /* Anything else may consume keys in ways not known here. */
+        else if (strcmp (head, "input-method") != 0 &&
+                 strcmp (head, "description") != 0 &&
+                 strcmp (head, "title") != 0 &&
+                 strcmp (head, "variable") != 0 &&
+                 strcmp (head, "macro") != 0) {
+            ok = FALSE;
+        }
+    }
+
+    g_hash_table_destroy (commands);
+    g_ptr_array_free (forms, TRUE);
+
+    if (!ok || g_hash_table_size (keys) == 0) {
+        g_hash_table_destroy (keys);
+        return NULL;
+    }
+    return keys;
+}
@@ -0,0 +1,54 @@
+/* vim:set et sts=4: */
+#ifndef __MIMSCAN_H__
+#define __MIMSCAN_H__
+
+#include <glib.h>
+#include "directmap.h"
+
+/* What engine enumeration needs from the header of a .mim file */
+struct _IBusM17NMimHeader {
+    gchar *lang;
+    gchar *name;
+    gchar *title;
+    /* translated through the m17n-db domain if marked with (_ ...) */
+    gchar *description;
+    /* icon file found in the database directories, or NULL */
+    gchar *icon;
+    /* whether the candidates-charset variable is declared */
+    gboolean has_candidates_charset;
+};
+
+typedef struct _IBusM17NMimHeader IBusM17NMimHeader;
+
+IBusM17NMimHeader
+           *ibus_m17n_mim_header_scan   (const gchar        *filename);
+void        ibus_m17n_mim_header_free   (IBusM17NMimHeader  *header);
+
+/* Return the m17n database directories, highest priority first */
+gchar     **ibus_m17n_mim_get_db_dirs   (void);
+
+/* Scan the headers of all .mim files in the database directories.
+   Keys are "LANG:NAME", files that can not be parsed are left out. */
+GHashTable *ibus_m17n_mim_scan_db_dirs  (void);
+
+/* Return the .mim file defining LANG NAME under its conventional
+   name in the database directories, or NULL */
+gchar      *ibus_m17n_mim_find_file     (const gchar        *lang,
+                                         const gchar        *name);
+
+/* Compile a .mim file which only maps key sequences to text in a
+   single state into a direct map.  Return NULL if the file uses
+   anything else, such as states, commands in maps, candidates,
+   includes or surrounding text. */
+IBusM17NDirectMap
+           *ibus_m17n_mim_direct_map_load
+                                        (const gchar        *filename);
+
+/* Return the set of names of all keys the maps of a .mim file refer
+   to.  Return NULL if other keys may be consumed as well, for
+   example through included maps, modules, commands the user can
+   rebind or the catch-all nil branch of a state. */
+GHashTable *ibus_m17n_mim_consumed_keys_load
+                                        (const gchar        *filename);
+
+#endif
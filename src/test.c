@@ -5,7 +5,11 @@
 
 #include <ibus.h>
 #include <locale.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
 #include "m17nutil.h"
+#include "mimscan.h"
 
 static void
 test_output_component (void)
@@ -33,6 +37,7 @@ test_engine_config (void)
     config = ibus_m17n_get_engine_config ("m17n:non:exsistent");
     g_assert_cmpint (config->rank, ==, 0);
     g_assert_cmpint (config->preedit_highlight, ==, 0);
+    g_assert_cmpstr (config->reference_layout, ==, "us");
     ibus_m17n_engine_config_free (config);
 
     config = ibus_m17n_get_engine_config ("m17n:si:wijesekara");
@@ -49,6 +54,324 @@ test_engine_config (void)
     g_assert_cmpint (config->rank, ==, 0);
     g_assert_cmpint (config->preedit_highlight, ==, 0);
     ibus_m17n_engine_config_free (config);
+
+    /* later rules override earlier ones whatever their pattern is */
+    config = ibus_m17n_get_engine_config ("m17n:as:kbd");
+    g_assert_cmpstr (config->symbol, ==, "ক");
+    ibus_m17n_engine_config_free (config);
+
+    config = ibus_m17n_get_engine_config ("m17n:ks:kbd");
+    g_assert_cmpint (config->rank, ==, 2);
+    g_assert_cmpstr (config->symbol, ==, "خ");
+    ibus_m17n_engine_config_free (config);
+
+    config = ibus_m17n_get_engine_config ("m17n:xx:kbd");
+    g_assert_cmpstr (config->symbol, ==, "");
+    ibus_m17n_engine_config_free (config);
+}
+
+static void
+test_config_compile (void)
+{
+    const gchar *pkgdatadir;
+    gchar *xml_files[2] = { NULL, NULL };
+    gchar *filename, *contents;
+    gsize length;
+    GError *error = NULL;
+    gint fd;
+
+    pkgdatadir = g_getenv ("IBUS_M17N_PKGDATADIR");
+    xml_files[0] = g_build_filename (pkgdatadir ? pkgdatadir : ".",
+                                     "default.xml", NULL);
+    fd = g_file_open_tmp ("test-m17n-XXXXXX.bin", &filename, NULL);
+    g_assert_cmpint (fd, >=, 0);
+    close (fd);
+
+    g_assert (ibus_m17n_config_compile (xml_files, filename, &error));
+    g_assert_no_error (error);
+    g_assert (g_file_get_contents (filename, &contents, &length, NULL));
+    g_assert_cmpuint (length, >, 8);
+    g_assert (memcmp (contents, "IM17NCFG", 8) == 0);
+    g_free (contents);
+
+    g_unlink (filename);
+    g_free (filename);
+    g_free (xml_files[0]);
+}
+
+/* default.xml and one override file for the round trip test, the
+   symbol of the override is filled in by the test */
+#define CONFIG_ROUNDTRIP_DEFAULT \
+    "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n" \
+    "<engines>\n" \
+    " <engine><name>m17n:*</name><rank>0</rank><symbol></symbol>" \
+    "<reference-layout>us</reference-layout></engine>\n" \
+    " <engine><name>m17n:xx:a</name><rank>2</rank>" \
+    "<longname>A</longname></engine>\n" \
+    " <engine><name>m17n:yy:*</name><rank>-1</rank></engine>\n" \
+    "</engines>\n"
+#define CONFIG_ROUNDTRIP_OVERRIDE \
+    "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n" \
+    "<engines>\n" \
+    " <engine><name>m17n:xx:*</name><symbol>%s</symbol>" \
+    "<layout>fr</layout><preedit-highlight>TRUE</preedit-highlight></engine>\n" \
+    "</engines>\n"
+
+static void
+assert_config_roundtrip (void)
+{
+    static const struct {
+        const gchar *name;
+        gint rank;
+        gboolean overridden;
+        const gchar *longname;
+        const gchar *layout;
+        gboolean preedit_highlight;
+    } expected[] = {
+        { "m17n:zz:kbd", 0, FALSE, NULL, NULL, FALSE },
+        { "m17n:yy:kbd", -1, FALSE, NULL, NULL, FALSE },
+        { "m17n:xx:a", 2, TRUE, "A", "fr", TRUE },
+        { "m17n:xx:b", 0, TRUE, NULL, "fr", TRUE },
+    };
+    const gchar *symbol = g_getenv ("TEST_M17N_OVERRIDE_SYMBOL");
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (expected); i++) {
+        IBusM17NEngineConfig *config;
+
+        config = ibus_m17n_get_engine_config (expected[i].name);
+        g_assert_cmpint (config->rank, ==, expected[i].rank);
+        g_assert_cmpstr (config->symbol, ==,
+                         expected[i].overridden ? symbol : "");
+        g_assert_cmpstr (config->longname, ==, expected[i].longname);
+        g_assert_cmpstr (config->layout, ==, expected[i].layout);
+        g_assert_cmpstr (config->reference_layout, ==, "us");
+        g_assert_cmpint (config->preedit_highlight, ==,
+                         expected[i].preedit_highlight);
+        ibus_m17n_engine_config_free (config);
+    }
+}
+
+static void
+write_config_roundtrip_override (const gchar *filename,
+                                 const gchar *symbol)
+{
+    gchar *contents;
+
+    contents = g_strdup_printf (CONFIG_ROUNDTRIP_OVERRIDE, symbol);
+    g_assert (g_file_set_contents (filename, contents, -1, NULL));
+    g_free (contents);
+    g_setenv ("TEST_M17N_OVERRIDE_SYMBOL", symbol, TRUE);
+}
+
+/* The rules mapped from default.bin must match the rules parsed from
+   the XML files, and editing an override must not be masked by a
+   stale default.bin.  The rules are loaded once per process, so each
+   case runs in a subprocess. */
+static void
+test_config_roundtrip (void)
+{
+    gchar *pkgdatadir, *overridesdir, *saved_pkgdatadir;
+    gchar *xml_files[3] = { NULL, NULL, NULL };
+    gchar *filename;
+    GError *error = NULL;
+
+    if (g_test_subprocess ()) {
+        assert_config_roundtrip ();
+        return;
+    }
+
+    pkgdatadir = g_dir_make_tmp ("test-m17n-XXXXXX", NULL);
+    g_assert (pkgdatadir != NULL);
+    overridesdir = g_build_filename (pkgdatadir, "overrides", NULL);
+    g_assert_cmpint (g_mkdir (overridesdir, 0700), ==, 0);
+
+    xml_files[0] = g_build_filename (pkgdatadir, "default.xml", NULL);
+    xml_files[1] = g_build_filename (overridesdir, "10-site.xml", NULL);
+    filename = g_build_filename (pkgdatadir, "default.bin", NULL);
+    g_assert (g_file_set_contents (xml_files[0], CONFIG_ROUNDTRIP_DEFAULT,
+                                   -1, NULL));
+    write_config_roundtrip_override (xml_files[1], "o");
+    g_assert (ibus_m17n_config_compile (xml_files, filename, &error));
+    g_assert_no_error (error);
+    saved_pkgdatadir = g_strdup (g_getenv ("IBUS_M17N_PKGDATADIR"));
+    g_setenv ("IBUS_M17N_PKGDATADIR", pkgdatadir, TRUE);
+
+    /* from default.bin */
+    g_test_trap_subprocess (NULL, 0, 0);
+    g_test_trap_assert_passed ();
+
+    /* from the XML files, default.bin is stale */
+    write_config_roundtrip_override (xml_files[1], "p");
+    g_test_trap_subprocess (NULL, 0, 0);
+    g_test_trap_assert_passed ();
+
+    /* from the XML files, without default.bin */
+    g_unlink (filename);
+    g_test_trap_subprocess (NULL, 0, 0);
+    g_test_trap_assert_passed ();
+
+    if (saved_pkgdatadir != NULL)
+        g_setenv ("IBUS_M17N_PKGDATADIR", saved_pkgdatadir, TRUE);
+    else
+        g_unsetenv ("IBUS_M17N_PKGDATADIR");
+    g_free (saved_pkgdatadir);
+    g_unlink (xml_files[1]);
+    g_unlink (xml_files[0]);
+    g_rmdir (overridesdir);
+    g_rmdir (pkgdatadir);
+    g_free (filename);
+    g_free (xml_files[1]);
+    g_free (xml_files[0]);
+    g_free (overridesdir);
+    g_free (pkgdatadir);
+}
+
+static gchar *
+write_mim_file (const gchar *contents)
+{
+    gchar *filename;
+    gint fd;
+
+    fd = g_file_open_tmp ("test-m17n-XXXXXX.mim", &filename, NULL);
+    g_assert_cmpint (fd, >=, 0);
+    close (fd);
+    g_assert (g_file_set_contents (filename, contents, -1, NULL));
+
+    return filename;
+}
+
+static void
+test_mim_header (void)
+{
+    IBusM17NMimHeader *header;
+    gchar *filename;
+
+    filename = write_mim_file (
+        ";; -*- coding: utf-8; mode: lisp -*-\n"
+        "(input-method xx test (version \"1.0\"))\n"
+        "(description \"A \\\"test\\\" input method.\nSecond line.\")\n"
+        "(title \"T\")\n"
+        "(variable\n"
+        " (dummy (_ \"Dummy\") ?\\( ?\xe3\x81\x82)\n"
+        " (candidates-charset nil utf-8))\n"
+        "(command (toggle (_ \"Toggle\") (C-\\ )))\n"
+        "(map (starter (\"a\" \"b\")))\n"
+        "(title \"ignored after map\")\n");
+    header = ibus_m17n_mim_header_scan (filename);
+    g_assert (header != NULL);
+    g_assert_cmpstr (header->lang, ==, "xx");
+    g_assert_cmpstr (header->name, ==, "test");
+    g_assert_cmpstr (header->title, ==, "T");
+    g_assert_cmpstr (header->description, ==,
+                     "A \"test\" input method.\nSecond line.");
+    g_assert (header->has_candidates_charset);
+    ibus_m17n_mim_header_free (header);
+    g_unlink (filename);
+    g_free (filename);
+
+    filename = write_mim_file ("(input-method xx broken\n(map (a \"b\"");
+    header = ibus_m17n_mim_header_scan (filename);
+    g_assert (header == NULL);
+    g_unlink (filename);
+    g_free (filename);
+}
+
+static void
+test_mim_direct_map (void)
+{
+    IBusM17NDirectMap *map;
+    gchar *filename;
+    gint node;
+
+    filename = write_mim_file (
+        "(input-method xx direct)\n"
+        "(title \"D\")\n"
+        "(map (trans (\"k\" \"\xe0\xa4\x95\")\n"
+        "            (\"kh\" \"\xe0\xa4\x96\")\n"
+        "            ((S-a) ?A)))\n"
+        "(state (init (trans)))\n");
+    map = ibus_m17n_mim_direct_map_load (filename);
+    g_assert (map != NULL);
+    node = ibus_m17n_direct_map_step (map, IBUS_M17N_DIRECT_MAP_ROOT, "k");
+    g_assert_cmpint (node, >, 0);
+    g_assert (!ibus_m17n_direct_map_is_leaf (map, node));
+    g_assert_cmpstr (ibus_m17n_direct_map_get_output (map, node), ==,
+                     "\xe0\xa4\x95");
+    node = ibus_m17n_direct_map_step (map, node, "h");
+    g_assert_cmpint (node, >, 0);
+    g_assert (ibus_m17n_direct_map_is_leaf (map, node));
+    g_assert_cmpstr (ibus_m17n_direct_map_get_output (map, node), ==,
+                     "\xe0\xa4\x96");
+    g_assert_cmpint (ibus_m17n_direct_map_step (map, node, "h"), ==, -1);
+    node = ibus_m17n_direct_map_step (map, IBUS_M17N_DIRECT_MAP_ROOT, "S-a");
+    g_assert_cmpstr (ibus_m17n_direct_map_get_output (map, node), ==, "A");
+    ibus_m17n_direct_map_free (map);
+    g_unlink (filename);
+    g_free (filename);
+
+    /* A state shift needs the real input method. */
+    filename = write_mim_file (
+        "(input-method xx stateful)\n"
+        "(map (trans (\"k\" \"K\")) (toggle ((C-t))))\n"
+        "(state (init (trans) (toggle (shift other)))\n"
+        "       (other (trans)))\n");
+    g_assert (ibus_m17n_mim_direct_map_load (filename) == NULL);
+    g_unlink (filename);
+    g_free (filename);
+
+    /* So does a key sequence bound through a command. */
+    filename = write_mim_file (
+        "(input-method xx command)\n"
+        "(command (next \"Next\" (C-n)))\n"
+        "(map (trans (\"k\" \"K\") ((next) \"N\")))\n");
+    g_assert (ibus_m17n_mim_direct_map_load (filename) == NULL);
+    g_unlink (filename);
+    g_free (filename);
+}
+
+static void
+test_mim_consumed_keys (void)
+{
+    GHashTable *keys;
+    gchar *filename;
+
+    filename = write_mim_file (
+        "(input-method xx keys)\n"
+        "(command (toggle \"Toggle\" (C-\\ )))\n"
+        "(map (trans (\"ka\" \"K\") ((A-x) \"X\") ((0x3b) ?;))\n"
+        "     (toggle ((C-t))))\n"
+        "(state (init (trans) (toggle (shift other)))\n"
+        "       (other (trans)))\n");
+    keys = ibus_m17n_mim_consumed_keys_load (filename);
+    g_assert (keys != NULL);
+    g_assert (g_hash_table_contains (keys, "k"));
+    g_assert (g_hash_table_contains (keys, "a"));
+    g_assert (g_hash_table_contains (keys, "A-x"));
+    g_assert (g_hash_table_contains (keys, ";"));
+    g_assert (g_hash_table_contains (keys, "C-t"));
+    g_assert (!g_hash_table_contains (keys, "C-s"));
+    g_hash_table_destroy (keys);
+    g_unlink (filename);
+    g_free (filename);
+
+    /* Included maps may consume any key. */
+    filename = write_mim_file (
+        "(input-method xx included)\n"
+        "(include (t nil global) map)\n"
+        "(map (trans (\"k\" \"K\")))\n");
+    g_assert (ibus_m17n_mim_consumed_keys_load (filename) == NULL);
+    g_unlink (filename);
+    g_free (filename);
+
+    /* So does the nil branch of a state. */
+    filename = write_mim_file (
+        "(input-method xx catchall)\n"
+        "(map (trans (\"k\" \"K\")))\n"
+        "(state (init (trans) (nil (shift init))))\n");
+    g_assert (ibus_m17n_mim_consumed_keys_load (filename) == NULL);
+    g_unlink (filename);
+    g_free (filename);
 }
 
 int main (int argc, char **argv)
@@ -61,6 +384,11 @@ int main (int argc, char **argv)
 
     g_test_add_func ("/test-m17n/output-component", test_output_component);
     g_test_add_func ("/test-m17n/engine-config", test_engine_config);
+    g_test_add_func ("/test-m17n/config-compile", test_config_compile);
+    g_test_add_func ("/test-m17n/config-roundtrip", test_config_roundtrip);
+    g_test_add_func ("/test-m17n/mim-header", test_mim_header);
+    g_test_add_func ("/test-m17n/mim-direct-map", test_mim_direct_map);
+    g_test_add_func ("/test-m17n/mim-consumed-keys", test_mim_consumed_keys);
 
     return g_test_run ();
 }
@@ -0,0 +1,178 @@
+/* vim:set et sts=4: */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+#include <glib-unix.h>
+#include <signal.h>
+#include <unistd.h>
+#include "trace.h"
+
+/* Number of events kept, older events are overwritten */
+#define TRACE_RING_SIZE 8192
+
+struct _IBusM17NTraceEvent {
+    gint64 start;
+    gint64 duration;
+    IBusM17NTraceStage stage;
+    const gchar *engine;
+    const gchar *arg;
+};
+typedef struct _IBusM17NTraceEvent IBusM17NTraceEvent;
+
+gboolean ibus_m17n_trace_enabled = FALSE;
+
+static IBusM17NTraceEvent trace_ring[TRACE_RING_SIZE];
+static gint trace_head = 0;
+static guint trace_dumps = 0;
+
+static const gchar *trace_stage_names[IBUS_M17N_TRACE_LAST] = {
+    "key-event",
+    "compose",
+    "key-to-symbol",
+    "minput-filter",
+    "minput-lookup",
+    "convert",
+    "callback",
+    "commit",
+    "forward",
+    "update-preedit",
+    "update-lookup-table",
+    "update-status",
+};
+
+static gboolean
+ibus_m17n_trace_dump_cb (gpointer user_data)
+{
+    GError *error = NULL;
+    gchar *filename;
+
+    filename = ibus_m17n_trace_dump (&error);
+    if (filename == NULL) {
+        g_warning ("can't write trace: %s", error->message);
+        g_error_free (error);
+    }
+    else {
+        g_message ("trace written to %s", filename);
+        g_free (filename);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+void
+ibus_m17n_trace_init (gboolean enable)
+{
+    const gchar *env = g_getenv ("IBUS_M17N_TRACE");
+
+    if (env != NULL && *env != '\0' && g_strcmp0 (env, "0") != 0)
+        enable = TRUE;
+
+    if (!enable || ibus_m17n_trace_enabled)
+        return;
+
+    ibus_m17n_trace_enabled = TRUE;
+    g_unix_signal_add (SIGUSR1, ibus_m17n_trace_dump_cb, NULL);
+}
+
+void
+ibus_m17n_trace_record (IBusM17NTraceStage  stage,
+                        gint64              start,
+                        const gchar        *engine,
+                        const gchar        *arg)
+{
+    IBusM17NTraceEvent *event;
+    guint i;
+
+    i = (guint) g_atomic_int_add (&trace_head, 1) % TRACE_RING_SIZE;
+    event = &trace_ring[i];
+    event->start = start;
+    event->duration = g_get_monotonic_time () - start;
+    event->stage = stage;
+    event->engine = engine;
+    event->arg = arg;
+}
+
+static void
+ibus_m17n_trace_append_json_string (GString     *output,
+                                    const gchar *str)
+{
+    const gchar *p;
+
+    g_string_append_c (output, '"');
+    for (p = str; *p; p++) {
+        switch (*p) {
+        case '"':
+            g_string_append (output, "\\\"");
+            break;
+        case '\\':
+            g_string_append (output, "\\\\");
+            break;
+        default:
+            if ((guchar) *p < 0x20)
+                g_string_append_printf (output, "\\u%04x", (guchar) *p);
+            else
+                g_string_append_c (output, *p);
+            break;
+        }
+    }
+    g_string_append_c (output, '"');
+}
+
+gchar *
+ibus_m17n_trace_dump (GError **error)
+{
+    GString *output;
+    gchar *dirname, *basename, *filename;
+    guint head, first, i;
+    gint pid = getpid ();
+    gboolean ok;
+
+    head = (guint) g_atomic_int_get (&trace_head);
+    first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+    output = g_string_sized_new (128 * (head - first) + 32);
+    g_string_append (output, "{\"traceEvents\":[");
+    for (i = first; i < head; i++) {
+        IBusM17NTraceEvent *event = &trace_ring[i % TRACE_RING_SIZE];
+
+        if (i != first)
+            g_string_append_c (output, ',');
+        g_string_append_printf (output,
+                                "\n{\"name\":\"%s\",\"cat\":\"m17n\","
+                                "\"ph\":\"X\",\"ts\":%" G_GINT64_FORMAT ","
+                                "\"dur\":%" G_GINT64_FORMAT ","
+                                "\"pid\":%d,\"tid\":%d,\"args\":{",
+                                trace_stage_names[event->stage],
+                                event->start,
+                                event->duration,
+                                pid, pid);
+        if (event->engine) {
+            g_string_append (output, "\"engine\":");
+            ibus_m17n_trace_append_json_string (output, event->engine);
+        }
+        if (event->arg) {
+            g_string_append (output, event->engine ? ",\"arg\":" : "\"arg\":");
+            ibus_m17n_trace_append_json_string (output, event->arg);
+        }
+        g_string_append (output, "}}");
+    }
+    g_string_append (output, "\n]}\n");
+
+    dirname = g_build_filename (g_get_user_cache_dir (), "ibus-m17n", NULL);
+    g_mkdir_with_parents (dirname, 0700);
+    basename = g_strdup_printf ("trace-%d-%u.json", pid, trace_dumps++);
+    filename = g_build_filename (dirname, basename, NULL);
+    g_free (dirname);
+    g_free (basename);
+
+    ok = g_file_set_contents (filename, output->str, output->len, error);
+    g_string_free (output, TRUE);
+    if (!ok) {
+        g_free (filename);
+        return NULL;
+    }
+
+    return filename;
+}
@@ -0,0 +1,54 @@
+/* vim:set et sts=4: */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <glib.h>
+
+/* Stages of a key event recorded by ibus_m17n_trace_record() */
+typedef enum {
+    IBUS_M17N_TRACE_KEY_EVENT,
+    IBUS_M17N_TRACE_COMPOSE,
+    IBUS_M17N_TRACE_KEY_TO_SYMBOL,
+    IBUS_M17N_TRACE_FILTER,
+    IBUS_M17N_TRACE_LOOKUP,
+    IBUS_M17N_TRACE_CONVERT,
+    IBUS_M17N_TRACE_CALLBACK,
+    IBUS_M17N_TRACE_COMMIT,
+    IBUS_M17N_TRACE_FORWARD,
+    IBUS_M17N_TRACE_UPDATE_PREEDIT,
+    IBUS_M17N_TRACE_UPDATE_LOOKUP_TABLE,
+    IBUS_M17N_TRACE_UPDATE_STATUS,
+    IBUS_M17N_TRACE_LAST
+} IBusM17NTraceStage;
+
+extern gboolean ibus_m17n_trace_enabled;
+
+/* Enable tracing if ENABLE is TRUE or IBUS_M17N_TRACE is set in the
+   environment.  While enabled, SIGUSR1 writes the recorded events to
+   the user cache directory in the Chrome trace event format. */
+void     ibus_m17n_trace_init   (gboolean            enable);
+
+/* Write the recorded events to a new file and return its name */
+gchar   *ibus_m17n_trace_dump   (GError            **error);
+
+/* ENGINE and ARG must stay valid for the lifetime of the process,
+   e.g. class names or msymbol_name() results. */
+void     ibus_m17n_trace_record (IBusM17NTraceStage  stage,
+                                 gint64              start,
+                                 const gchar        *engine,
+                                 const gchar        *arg);
+
+/* Start time of a stage, 0 if tracing is disabled */
+static inline gint64
+ibus_m17n_trace_now (void)
+{
+    return G_UNLIKELY (ibus_m17n_trace_enabled) ? g_get_monotonic_time () : 0;
+}
+
+#define IBUS_M17N_TRACE(stage, start, engine, arg)                      \
+    G_STMT_START {                                                      \
+        if (G_UNLIKELY ((start) != 0))                                  \
+            ibus_m17n_trace_record ((stage), (start), (engine), (arg)); \
+    } G_STMT_END
+
+#endif